@@ -0,0 +1,189 @@
+#include "ChangeLog.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace detail
+{
+  template <typename T>
+  void take(std::span<const uint8_t> data, std::size_t& offset, T& out_value)
+  {
+    if (data.size() - offset < sizeof(T)) {
+      throw std::runtime_error("The change log is truncated.");
+    }
+    std::memcpy(&out_value, data.data() + offset, sizeof(T));
+    offset += sizeof(T);
+  }
+
+  void take(std::span<const uint8_t> data,
+    std::size_t& offset,
+    Point& out_point)
+  {
+    take(data, offset, out_point.id);
+    take(data, offset, out_point.rank);
+    take(data, offset, out_point.x);
+    take(data, offset, out_point.y);
+  }
+}
+
+ChangeLog::ChangeLog() :
+  data_(),
+  record_count_(0)
+{}
+
+template <typename T>
+void ChangeLog::put(const T& value)
+{
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+  data_.insert(data_.end(), bytes, bytes + sizeof(T));
+}
+
+void ChangeLog::put(const detail::Point& point)
+{
+  put(point.id);
+  put(point.rank);
+  put(point.x);
+  put(point.y);
+}
+
+void ChangeLog::append_root(const detail::Rect& bounds)
+{
+  put(Op::Root);
+  put(bounds);
+  ++record_count_;
+}
+
+void ChangeLog::append_grow(uint8_t quadrant, const detail::Rect& bounds)
+{
+  put(Op::Grow);
+  put(quadrant);
+  put(bounds);
+  ++record_count_;
+}
+
+void ChangeLog::append_insert(uint64_t key, const detail::Point& point)
+{
+  put(Op::Insert);
+  put(key);
+  put(point);
+  ++record_count_;
+}
+
+void ChangeLog::append_erase(uint64_t key, const detail::Point& point)
+{
+  put(Op::Erase);
+  put(key);
+  put(point);
+  ++record_count_;
+}
+
+void ChangeLog::append_move(uint64_t from_key,
+  const detail::Point& point,
+  uint64_t to_key,
+  float x,
+  float y)
+{
+  put(Op::Move);
+  put(from_key);
+  put(point);
+  put(to_key);
+  put(x);
+  put(y);
+  ++record_count_;
+}
+
+void ChangeLog::append_split(uint64_t key)
+{
+  put(Op::Split);
+  put(key);
+  ++record_count_;
+}
+
+void ChangeLog::append_insert_expiring(uint64_t key,
+  const detail::Point& point,
+  uint64_t generation)
+{
+  put(Op::InsertExpiring);
+  put(key);
+  put(point);
+  put(generation);
+  ++record_count_;
+}
+
+void ChangeLog::append_expire(uint64_t generation)
+{
+  put(Op::Expire);
+  put(generation);
+  ++record_count_;
+}
+
+void ChangeLog::append_encoded(std::span<const uint8_t> records)
+{
+  Record record;
+  for (std::size_t offset = 0; offset < records.size();) {
+    offset = decode(records, offset, record);
+    ++record_count_;
+  }
+  data_.insert(data_.end(), records.begin(), records.end());
+}
+
+std::span<const uint8_t> ChangeLog::data() const
+{
+  return data_;
+}
+
+std::size_t ChangeLog::record_count() const
+{
+  return record_count_;
+}
+
+void ChangeLog::clear()
+{
+  data_.clear();
+  record_count_ = 0;
+}
+
+std::size_t ChangeLog::decode(std::span<const uint8_t> data,
+  std::size_t offset,
+  Record& out_record)
+{
+  out_record = {};
+  detail::take(data, offset, out_record.op);
+  switch (out_record.op) {
+  case Op::Root:
+    detail::take(data, offset, out_record.bounds);
+    break;
+  case Op::Grow:
+    detail::take(data, offset, out_record.quadrant);
+    detail::take(data, offset, out_record.bounds);
+    break;
+  case Op::Insert:
+  case Op::Erase:
+    detail::take(data, offset, out_record.key);
+    detail::take(data, offset, out_record.point);
+    break;
+  case Op::Move:
+    detail::take(data, offset, out_record.key);
+    detail::take(data, offset, out_record.point);
+    detail::take(data, offset, out_record.to_key);
+    detail::take(data, offset, out_record.x);
+    detail::take(data, offset, out_record.y);
+    break;
+  case Op::Split:
+    detail::take(data, offset, out_record.key);
+    break;
+  case Op::InsertExpiring:
+    detail::take(data, offset, out_record.key);
+    detail::take(data, offset, out_record.point);
+    detail::take(data, offset, out_record.generation);
+    break;
+  case Op::Expire:
+    detail::take(data, offset, out_record.generation);
+    break;
+  default:
+    throw std::runtime_error("Unknown change log record " +
+      std::to_string(static_cast<int>(out_record.op)) + ".");
+  }
+  return offset;
+}
@@ -0,0 +1,108 @@
+#ifndef CHANGE_LOG_H
+#define CHANGE_LOG_H
+
+#include "QuadTree.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Append-only binary log of the mutations applied to a QuadTree, written by
+// the tree it is attached to with QuadTree::set_change_log and replayed on
+// a replica with QuadTree::apply_log. Records carry the quad keys and split
+// decisions the primary already made, so a replica neither keys points nor
+// checks block sizes. Fields are stored unaligned in host byte order, for
+// replicas on the same host.
+class __declspec(dllexport) ChangeLog
+{
+public:
+  enum class Op : uint8_t {
+    // The tree was empty and got a root cell of bounds.
+    Root = 1,
+    // The root grew, the old root moving into quadrant of the new root of
+    // bounds.
+    Grow = 2,
+    // point was added to the leaf key, created if missing.
+    Insert = 3,
+    // point was removed from the leaf key.
+    Erase = 4,
+    // point was removed from the leaf key and added, at (x, y), to the leaf
+    // to_key.
+    Move = 5,
+    // The leaf key was split.
+    Split = 6,
+    // point was added to the leaf key, created if missing, in expiry
+    // generation.
+    InsertExpiring = 7,
+    // Every expiry generation before generation was dropped.
+    Expire = 8
+  };
+
+  struct __declspec(dllexport) Record
+  {
+    Op op;
+    uint64_t key;
+    detail::Point point;
+    uint64_t to_key;
+    float x;
+    float y;
+    uint8_t quadrant;
+    detail::Rect bounds;
+    uint64_t generation;
+  };
+
+  ChangeLog();
+
+  void append_root(const detail::Rect& bounds);
+
+  void append_grow(uint8_t quadrant, const detail::Rect& bounds);
+
+  void append_insert(uint64_t key, const detail::Point& point);
+
+  void append_erase(uint64_t key, const detail::Point& point);
+
+  void append_move(uint64_t from_key,
+    const detail::Point& point,
+    uint64_t to_key,
+    float x,
+    float y);
+
+  void append_split(uint64_t key);
+
+  void append_insert_expiring(uint64_t key,
+    const detail::Point& point,
+    uint64_t generation);
+
+  void append_expire(uint64_t generation);
+
+  // Appends records already encoded by another log.
+  void append_encoded(std::span<const uint8_t> records);
+
+  std::span<const uint8_t> data() const;
+
+  std::size_t record_count() const;
+
+  // Drops every record, typically once a checkpoint covering them has been
+  // written with QuadTree::write_checkpoint.
+  void clear();
+
+  // Decodes the record starting at offset into out_record and returns the
+  // offset of the next one. Throws on an unknown or truncated record.
+  static std::size_t decode(std::span<const uint8_t> data,
+    std::size_t offset,
+    Record& out_record);
+
+private:
+  template <typename T>
+  void put(const T& value);
+
+  // Writes the fields of point, leaving out its padding.
+  void put(const detail::Point& point);
+
+private:
+  std::vector<uint8_t> data_;
+  std::size_t record_count_;
+};
+
+#endif
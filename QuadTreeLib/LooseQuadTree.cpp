@@ -0,0 +1,196 @@
+#include "LooseQuadTree.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace detail
+{
+  Point center(const Rect& rect)
+  {
+    return { 0, 0, rect.lx + (rect.hx - rect.lx) * 0.5f,
+      rect.ly + (rect.hy - rect.ly) * 0.5f };
+  }
+
+  Rect loose_cell(const Rect& cell)
+  {
+    float half_w = (cell.hx - cell.lx) * 0.5f;
+    float half_h = (cell.hy - cell.ly) * 0.5f;
+    float slack = rect_slack(cell, cell);
+    return { cell.lx - half_w - slack, cell.ly - half_h - slack,
+      cell.hx + half_w + slack, cell.hy + half_h + slack };
+  }
+
+  // With its center inside a cell, a rect lies inside the cell's loose cell
+  // whenever it is no larger than the cell itself.
+  bool fits(const Rect& rect, const Rect& cell)
+  {
+    return (rect.hx - rect.lx) <= (cell.hx - cell.lx) &&
+      (rect.hy - rect.ly) <= (cell.hy - cell.ly);
+  }
+}
+
+LooseQuadTree::Node::Node(uint64_t quad_key) :
+  quad_key_(quad_key),
+  children_()
+{}
+
+LooseQuadTree::Node::~Node()
+{
+  for (Node* child : children_) {
+    delete child;
+  }
+}
+
+LooseQuadTree::LooseQuadTree(std::span<const detail::Rect> rects) :
+  rects_(rects),
+  root_(nullptr),
+  global_bounds_({})
+{
+  if (rects.empty()) {
+    return;
+  }
+  if (rects.size() > (std::numeric_limits<uint32_t>::max)()) {
+    throw std::runtime_error("LooseQuadTree holds at most 2^32 - 1 rects.");
+  }
+
+  global_bounds_ = rects_[0];
+  for (const detail::Rect& rect : rects_) {
+    global_bounds_.lx = (std::min)(global_bounds_.lx, rect.lx);
+    global_bounds_.ly = (std::min)(global_bounds_.ly, rect.ly);
+    global_bounds_.hx = (std::max)(global_bounds_.hx, rect.hx);
+    global_bounds_.hy = (std::max)(global_bounds_.hy, rect.hy);
+  }
+
+  std::vector<uint32_t> items(rects_.size());
+  for (std::size_t i = 0; i < items.size(); ++i) {
+    items[i] = static_cast<uint32_t>(i);
+  }
+  root_ = new Node(detail::keys::min_id(0));
+  build_tree(root_, global_bounds_, items, 0u);
+}
+
+LooseQuadTree::~LooseQuadTree()
+{
+  delete root_;
+}
+
+std::span<const detail::Rect> LooseQuadTree::rects() const
+{
+  return rects_;
+}
+
+const detail::Rect& LooseQuadTree::global_bounds() const
+{
+  return global_bounds_;
+}
+
+uint8_t LooseQuadTree::max_depth() const
+{
+  return max_depth_recursive(root_);
+}
+
+void LooseQuadTree::query(const detail::Rect& rect,
+  std::vector<uint32_t>& out_indices) const
+{
+  if (root_ != nullptr) {
+    query_recursive(root_, global_bounds_,
+      [&](const detail::Rect& other)
+      {
+        return detail::intersects(rect, other);
+      },
+      out_indices);
+  }
+}
+
+void LooseQuadTree::stab(const detail::Point& point,
+  std::vector<uint32_t>& out_indices) const
+{
+  if (root_ != nullptr) {
+    query_recursive(root_, global_bounds_,
+      [&](const detail::Rect& other)
+      {
+        return detail::contains(other, point);
+      },
+      out_indices);
+  }
+}
+
+void LooseQuadTree::build_tree(Node* node,
+  const detail::Rect& cell,
+  std::vector<uint32_t>& items,
+  uint8_t depth)
+{
+  if (items.size() <= MAX_BLOCK_SIZE || depth == detail::keys::max_depth()) {
+    node->items_.swap(items);
+    return;
+  }
+
+  // Rects no larger than a child cell move down to the child holding their
+  // center; the rest are too big for any child's loose cell and stay here.
+  detail::Children_t children;
+  detail::keys::compute_children(node->quad_key_, children);
+  const detail::Rect child_cell = detail::child_rect(cell, 0);
+  std::vector<uint32_t> buckets[4];
+  for (uint32_t index : items) {
+    const detail::Rect& rect = rects_[index];
+    if (!detail::fits(rect, child_cell)) {
+      node->items_.push_back(index);
+      continue;
+    }
+    uint64_t c_pid = detail::compute_quad_key(detail::center(rect),
+      depth + 1, global_bounds_);
+    std::size_t i = c_pid - children[0];
+    if (i >= 4) {
+      throw std::runtime_error("A quadkey got bucketed wrong.");
+    }
+    buckets[i].push_back(index);
+  }
+  items.clear();
+  items.shrink_to_fit();
+
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (!buckets[i].empty()) {
+      node->children_[i] = new Node(children[i]);
+      build_tree(node->children_[i], detail::child_rect(cell, i), buckets[i],
+        depth + 1);
+    }
+  }
+}
+
+int8_t LooseQuadTree::max_depth_recursive(const Node* node) const
+{
+  if (node == nullptr) {
+    return -1;
+  } else {
+    auto depth0 = max_depth_recursive(node->children_[0]);
+    auto depth1 = max_depth_recursive(node->children_[1]);
+    auto depth2 = max_depth_recursive(node->children_[2]);
+    auto depth3 = max_depth_recursive(node->children_[3]);
+    return 1 + (std::max)({ depth0, depth1, depth2, depth3 });
+  }
+}
+
+template <typename Overlaps>
+void LooseQuadTree::query_recursive(const Node* node,
+  const detail::Rect& cell,
+  const Overlaps& overlaps,
+  std::vector<uint32_t>& out_indices) const
+{
+  if (!overlaps(detail::loose_cell(cell))) {
+    return;
+  }
+
+  for (uint32_t index : node->items_) {
+    if (overlaps(rects_[index])) {
+      out_indices.push_back(index);
+    }
+  }
+
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (node->children_[i] != nullptr) {
+      query_recursive(node->children_[i], detail::child_rect(cell, i),
+        overlaps, out_indices);
+    }
+  }
+}
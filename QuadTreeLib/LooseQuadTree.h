@@ -0,0 +1,76 @@
+#ifndef LOOSE_QUAD_TREE_H
+#define LOOSE_QUAD_TREE_H
+
+#include "QuadTree.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Quad tree over extended objects. Every node owns a loose cell: its quad
+// key cell grown by half a cell on each side. A rect is stored at the
+// deepest node, keyed by the rect's center, whose loose cell still fully
+// contains it, so nothing is ever split across nodes and queries need no
+// widening. Like QuadTreeIndex it is built over a caller owned array that
+// must outlive it, and reports indices into that array.
+class __declspec(dllexport) LooseQuadTree
+{
+private:
+  struct __declspec(dllexport) Node
+  {
+    explicit Node(uint64_t quad_key);
+
+    ~Node();
+
+    uint64_t quad_key_;
+    std::vector<uint32_t> items_;
+    Node* children_[4];
+  };
+
+public:
+  constexpr static std::size_t MAX_BLOCK_SIZE = QuadTree::MAX_BLOCK_SIZE;
+
+  explicit LooseQuadTree(std::span<const detail::Rect> rects);
+
+  LooseQuadTree(const LooseQuadTree&) = delete;
+
+  LooseQuadTree& operator=(const LooseQuadTree&) = delete;
+
+  ~LooseQuadTree();
+
+  std::span<const detail::Rect> rects() const;
+
+  const detail::Rect& global_bounds() const;
+
+  uint8_t max_depth() const;
+
+  // Appends the index of every rect that overlaps rect, edges inclusive.
+  void query(const detail::Rect& rect,
+    std::vector<uint32_t>& out_indices) const;
+
+  // Appends the index of every rect that contains point, edges inclusive.
+  void stab(const detail::Point& point,
+    std::vector<uint32_t>& out_indices) const;
+
+private:
+  void build_tree(Node* node,
+    const detail::Rect& cell,
+    std::vector<uint32_t>& items,
+    uint8_t depth);
+
+  int8_t max_depth_recursive(const Node* node) const;
+
+  template <typename Overlaps>
+  void query_recursive(const Node* node,
+    const detail::Rect& cell,
+    const Overlaps& overlaps,
+    std::vector<uint32_t>& out_indices) const;
+
+private:
+  std::span<const detail::Rect> rects_;
+  Node* root_;
+  detail::Rect global_bounds_;
+};
+
+#endif
@@ -0,0 +1,337 @@
+#include "PersistentQuadTree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+bool PersistentQuadTree::Node::is_leaf() const
+{
+  return children_[0] == nullptr && children_[1] == nullptr &&
+    children_[2] == nullptr && children_[3] == nullptr;
+}
+
+PersistentQuadTree::Snapshot::Snapshot(VersionPtr_t version) :
+  version_(std::move(version))
+{}
+
+uint64_t PersistentQuadTree::Snapshot::version() const
+{
+  return version_->number;
+}
+
+std::size_t PersistentQuadTree::Snapshot::size() const
+{
+  return version_->root != nullptr ? version_->root->count_ : 0;
+}
+
+const detail::Rect& PersistentQuadTree::Snapshot::global_bounds() const
+{
+  return version_->global_bounds;
+}
+
+void PersistentQuadTree::Snapshot::query(const detail::Rect& rect,
+  std::vector<detail::Point>& out_points) const
+{
+  if (version_->root != nullptr) {
+    query_recursive(version_->root.get(), version_->global_bounds, rect,
+      out_points);
+  }
+}
+
+PersistentQuadTree::PersistentQuadTree(
+  std::span<const detail::Point> points) :
+  current_()
+{
+  auto version = std::make_shared<Version>();
+  version->global_bounds = {};
+  version->number = 0;
+  if (!points.empty()) {
+    QuadTree::compute_bounds(points, version->global_bounds);
+    std::vector<detail::Point> copy(points.begin(), points.end());
+    version->root = build(copy, version->global_bounds, 0u);
+  }
+  current_.store(std::move(version));
+}
+
+PersistentQuadTree::Snapshot PersistentQuadTree::snapshot() const
+{
+  return Snapshot(current_.load());
+}
+
+uint64_t PersistentQuadTree::version() const
+{
+  return current_.load()->number;
+}
+
+std::size_t PersistentQuadTree::size() const
+{
+  return snapshot().size();
+}
+
+detail::Rect PersistentQuadTree::global_bounds() const
+{
+  return current_.load()->global_bounds;
+}
+
+void PersistentQuadTree::insert(const detail::Point& point)
+{
+  if (!std::isfinite(point.x) || !std::isfinite(point.y)) {
+    throw std::runtime_error("Cannot insert a point that is not finite.");
+  }
+
+  VersionPtr_t current = current_.load();
+  auto next = std::make_shared<Version>(*current);
+  ++next->number;
+
+  if (next->root == nullptr) {
+    next->global_bounds = {
+      point.x - 0.5f, point.y - 0.5f, point.x + 0.5f, point.y + 0.5f
+    };
+  }
+
+  // Each step adds a parent over the old root, which is shared as is.
+  detail::Rect& bounds = next->global_bounds;
+  while (next->root != nullptr && !detail::contains(bounds, point)) {
+    const detail::Rect old_bounds = bounds;
+    float width = bounds.hx - bounds.lx;
+    float height = bounds.hy - bounds.ly;
+    if (width <= 0.0f) {
+      width = (std::max)(height, 1.0f);
+    }
+    if (height <= 0.0f) {
+      height = (std::max)(width, 1.0f);
+    }
+
+    bool grow_left = point.x < bounds.lx;
+    bool grow_down = point.y < bounds.ly;
+    if (grow_left) {
+      bounds.lx = bounds.hx - 2.0f * width;
+    } else {
+      bounds.hx = bounds.lx + 2.0f * width;
+    }
+    if (grow_down) {
+      bounds.ly = bounds.hy - 2.0f * height;
+    } else {
+      bounds.hy = bounds.ly + 2.0f * height;
+    }
+
+    auto root = std::make_shared<Node>();
+    root->count_ = next->root->count_;
+    const uint8_t quadrant = (grow_left ? 0x1 : 0x0) | (grow_down ? 0x2 : 0x0);
+    root->has_split_ = true;
+    root->kept_child_ = quadrant;
+    root->split_x_ = grow_left ? old_bounds.lx : old_bounds.hx;
+    root->split_y_ = grow_down ? old_bounds.ly : old_bounds.hy;
+    root->children_[quadrant] = next->root;
+    next->root = std::move(root);
+  }
+
+  next->root = insert_recursive(next->root, bounds, 0u, point);
+  current_.store(std::move(next));
+}
+
+bool PersistentQuadTree::erase(const detail::Point& point)
+{
+  VersionPtr_t current = current_.load();
+  if (current->root == nullptr) {
+    return false;
+  }
+
+  bool erased = false;
+  NodePtr_t root = erase_recursive(current->root, current->global_bounds,
+    point, erased);
+  if (!erased) {
+    return false;
+  }
+
+  auto next = std::make_shared<Version>(*current);
+  ++next->number;
+  next->root = std::move(root);
+  current_.store(std::move(next));
+  return true;
+}
+
+void PersistentQuadTree::query(const detail::Rect& rect,
+  std::vector<detail::Point>& out_points) const
+{
+  snapshot().query(rect, out_points);
+}
+
+PersistentQuadTree::NodePtr_t PersistentQuadTree::build(
+  std::span<detail::Point> points,
+  const detail::Rect& cell,
+  uint8_t depth)
+{
+  auto node = std::make_shared<Node>();
+  node->count_ = points.size();
+  if (points.size() <= MAX_BLOCK_SIZE || depth >= detail::keys::max_depth()) {
+    node->points_.assign(points.begin(), points.end());
+    return node;
+  }
+
+  std::size_t sizes[4];
+  detail::partition_by_child(points.begin(), points.end(),
+    [&cell](const detail::Point& p)
+    {
+      return detail::child_index(cell, p);
+    },
+    sizes);
+
+  std::size_t begin = 0;
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (sizes[i] != 0) {
+      node->children_[i] = build(points.subspan(begin, sizes[i]),
+        detail::child_rect(cell, i), depth + 1);
+    }
+    begin += sizes[i];
+  }
+  return node;
+}
+
+PersistentQuadTree::NodePtr_t PersistentQuadTree::insert_recursive(
+  const NodePtr_t& node,
+  const detail::Rect& cell,
+  uint8_t depth,
+  const detail::Point& point)
+{
+  if (node == nullptr) {
+    auto leaf = std::make_shared<Node>();
+    leaf->count_ = 1;
+    leaf->points_.push_back(point);
+    return leaf;
+  }
+
+  if (node->is_leaf()) {
+    if (node->points_.size() >= MAX_BLOCK_SIZE &&
+      depth < detail::keys::max_depth()) {
+      std::vector<detail::Point> points(node->points_);
+      points.push_back(point);
+      return build(points, cell, depth);
+    }
+    auto leaf = std::make_shared<Node>(*node);
+    ++leaf->count_;
+    leaf->points_.push_back(point);
+    return leaf;
+  }
+
+  auto copy = std::make_shared<Node>(*node);
+  ++copy->count_;
+  std::size_t i = child_slot(node.get(), cell, point);
+  copy->children_[i] = insert_recursive(node->children_[i],
+    child_cell(node.get(), cell, i), depth + 1, point);
+  return copy;
+}
+
+PersistentQuadTree::NodePtr_t PersistentQuadTree::erase_recursive(
+  const NodePtr_t& node,
+  const detail::Rect& cell,
+  const detail::Point& point,
+  bool& out_erased)
+{
+  if (node->is_leaf()) {
+    auto it = std::find_if(node->points_.begin(), node->points_.end(),
+      [&point](const detail::Point& p)
+      {
+        return detail::same_point(p, point);
+      });
+    if (it == node->points_.end()) {
+      return node;
+    }
+    out_erased = true;
+    if (node->count_ == 1) {
+      return nullptr;
+    }
+    auto leaf = std::make_shared<Node>();
+    leaf->count_ = node->count_ - 1;
+    leaf->points_.reserve(leaf->count_);
+    leaf->points_.insert(leaf->points_.end(), node->points_.begin(), it);
+    leaf->points_.insert(leaf->points_.end(), it + 1, node->points_.end());
+    return leaf;
+  }
+
+  // Insert took the same path, so the point can only be below this child.
+  std::size_t i = child_slot(node.get(), cell, point);
+  if (node->children_[i] == nullptr) {
+    return node;
+  }
+  NodePtr_t child = erase_recursive(node->children_[i],
+    child_cell(node.get(), cell, i), point, out_erased);
+  if (!out_erased) {
+    return node;
+  }
+
+  auto copy = std::make_shared<Node>(*node);
+  --copy->count_;
+  copy->children_[i] = std::move(child);
+  if (copy->count_ <= MAX_BLOCK_SIZE) {
+    auto leaf = std::make_shared<Node>();
+    leaf->count_ = copy->count_;
+    leaf->points_.reserve(leaf->count_);
+    collect(copy.get(), leaf->points_);
+    return leaf;
+  }
+  return copy;
+}
+
+detail::Rect PersistentQuadTree::child_cell(const Node* node,
+  const detail::Rect& cell,
+  std::size_t i)
+{
+  if (node->has_split_) {
+    return detail::child_rect(cell, i, node->split_x_, node->split_y_);
+  }
+  return detail::child_rect(cell, i);
+}
+
+std::size_t PersistentQuadTree::child_slot(const Node* node,
+  const detail::Rect& cell,
+  const detail::Point& p)
+{
+  if (node->has_split_) {
+    return detail::child_index(cell, p, node->split_x_, node->split_y_,
+      node->kept_child_);
+  }
+  return detail::child_index(cell, p);
+}
+
+void PersistentQuadTree::collect(const Node* node,
+  std::vector<detail::Point>& out_points)
+{
+  out_points.insert(out_points.end(), node->points_.begin(),
+    node->points_.end());
+  for (const NodePtr_t& child : node->children_) {
+    if (child != nullptr) {
+      collect(child.get(), out_points);
+    }
+  }
+}
+
+void PersistentQuadTree::query_recursive(const Node* node,
+  const detail::Rect& cell,
+  const detail::Rect& rect,
+  std::vector<detail::Point>& out_points)
+{
+  float slack = detail::rect_slack(cell, rect);
+  detail::Rect outer = {
+    cell.lx - slack, cell.ly - slack, cell.hx + slack, cell.hy + slack
+  };
+  if (!detail::intersects(outer, rect)) {
+    return;
+  }
+
+  if (node->is_leaf()) {
+    for (const detail::Point& p : node->points_) {
+      if (detail::contains(rect, p)) {
+        out_points.push_back(p);
+      }
+    }
+    return;
+  }
+
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (node->children_[i] != nullptr) {
+      query_recursive(node->children_[i].get(),
+        child_cell(node, cell, i), rect, out_points);
+    }
+  }
+}
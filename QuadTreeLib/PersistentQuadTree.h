@@ -0,0 +1,151 @@
+#ifndef PERSISTENT_QUAD_TREE_H
+#define PERSISTENT_QUAD_TREE_H
+
+#include "QuadTree.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+// QuadTree whose nodes are never modified once published. An update copies
+// only the nodes on the path from the root down to the changed leaf, and
+// every other node is shared with the previous version, so a snapshot() of
+// the tree costs one reference count increment however long it is kept.
+// Nodes hold no quad keys, their cells being implied by their path, which
+// lets the root grow without touching any existing node. A root added by
+// growing splits at the old root's corner rather than at its middle, so
+// the old root's cell comes back exactly.
+//
+// Updates must come from one thread at a time. snapshot() and the queries
+// of the tree and of any snapshot may run on any thread, concurrently with
+// the updates.
+class __declspec(dllexport) PersistentQuadTree
+{
+private:
+  struct Node;
+
+  typedef std::shared_ptr<const Node> NodePtr_t;
+
+  struct Node
+  {
+    bool is_leaf() const;
+
+    // Number of points below the node.
+    std::size_t count_;
+    std::vector<detail::Point> points_;
+    NodePtr_t children_[4];
+    // Set on a root added by growing, whose children meet at
+    // (split_x_, split_y_), the old root's corner. The old root, in slot
+    // kept_child_, keeps the points on its edges.
+    bool has_split_;
+    uint8_t kept_child_;
+    float split_x_;
+    float split_y_;
+  };
+
+  struct Version
+  {
+    NodePtr_t root;
+    detail::Rect global_bounds;
+    uint64_t number;
+  };
+
+  typedef std::shared_ptr<const Version> VersionPtr_t;
+
+public:
+  constexpr static std::size_t MAX_BLOCK_SIZE = QuadTree::MAX_BLOCK_SIZE;
+
+  // Immutable view of the tree as of one update. Nodes stay alive for as
+  // long as any snapshot or the tree itself still reaches them.
+  class __declspec(dllexport) Snapshot
+  {
+  public:
+    uint64_t version() const;
+
+    std::size_t size() const;
+
+    const detail::Rect& global_bounds() const;
+
+    // Appends every point inside rect, bounds inclusive, to out_points.
+    void query(const detail::Rect& rect,
+      std::vector<detail::Point>& out_points) const;
+
+  private:
+    friend class PersistentQuadTree;
+
+    explicit Snapshot(VersionPtr_t version);
+
+    VersionPtr_t version_;
+  };
+
+  explicit PersistentQuadTree(std::span<const detail::Point> points);
+
+  PersistentQuadTree(const PersistentQuadTree&) = delete;
+
+  PersistentQuadTree& operator=(const PersistentQuadTree&) = delete;
+
+  Snapshot snapshot() const;
+
+  // Number of updates applied since construction.
+  uint64_t version() const;
+
+  std::size_t size() const;
+
+  detail::Rect global_bounds() const;
+
+  // Adds point, copying the nodes on its path. A point outside of
+  // global_bounds() grows the root toward it as QuadTree::insert does.
+  void insert(const detail::Point& point);
+
+  // Removes one point equal to point in every field, copying the nodes on
+  // its path. Returns false, leaving the version unchanged, if there is
+  // none. A subtree left with at most MAX_BLOCK_SIZE points collapses into
+  // a leaf.
+  bool erase(const detail::Point& point);
+
+  // Appends every point inside rect, bounds inclusive, to out_points.
+  void query(const detail::Rect& rect,
+    std::vector<detail::Point>& out_points) const;
+
+private:
+  // Builds a subtree over points, partitioning them in place.
+  static NodePtr_t build(std::span<detail::Point> points,
+    const detail::Rect& cell,
+    uint8_t depth);
+
+  static NodePtr_t insert_recursive(const NodePtr_t& node,
+    const detail::Rect& cell,
+    uint8_t depth,
+    const detail::Point& point);
+
+  static NodePtr_t erase_recursive(const NodePtr_t& node,
+    const detail::Rect& cell,
+    const detail::Point& point,
+    bool& out_erased);
+
+  // Cell of node's child i, node's own cell being cell.
+  static detail::Rect child_cell(const Node* node,
+    const detail::Rect& cell,
+    std::size_t i);
+
+  // Index of node's child whose cell p falls in.
+  static std::size_t child_slot(const Node* node,
+    const detail::Rect& cell,
+    const detail::Point& p);
+
+  static void collect(const Node* node,
+    std::vector<detail::Point>& out_points);
+
+  static void query_recursive(const Node* node,
+    const detail::Rect& cell,
+    const detail::Rect& rect,
+    std::vector<detail::Point>& out_points);
+
+private:
+  std::atomic<VersionPtr_t> current_;
+};
+
+#endif
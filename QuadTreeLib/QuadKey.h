@@ -0,0 +1,278 @@
+#ifndef QUAD_KEY_H
+#define QUAD_KEY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+namespace detail
+{
+  typedef uint64_t Children_t[4];
+
+  // Header-only quad key arithmetic. The exported detail:: functions of the
+  // same names forward here; library code calls these directly so that they
+  // inline into build and traversal loops and fold on constant arguments.
+  namespace keys
+  {
+    constexpr uint8_t msb32(uint32_t x)
+    {
+      uint32_t depth = (x > 0xffff) << 4;
+      x >>= depth;
+      uint32_t shift = (x > 0xff) << 3;
+      x >>= shift;
+      depth |= shift;
+      shift = (x > 0xf) << 2;
+      x >>= shift;
+      depth |= shift;
+      shift = (x > 0x3) << 1;
+      x >>= shift;
+      depth |= shift;
+      shift = (x > 0x1);
+      depth |= shift;
+
+      return static_cast<uint8_t>(depth);
+    }
+
+    constexpr uint64_t spread_by_1_bit(int64_t x)
+    {
+      x &= 0x00000000ffffffffull;
+      x = (x | (x << 16)) & 0x0000ffff0000ffffull;
+      x = (x | (x << 8)) & 0x00ff00ff00ff00ffull;
+      x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0full;
+      x = (x | (x << 2)) & 0x3333333333333333ull;
+      x = (x | (x << 1)) & 0x5555555555555555ull;
+
+      return x;
+    }
+
+    constexpr int64_t compact_by_1_bit(int64_t x)
+    {
+      x &= 0x5555555555555555ull;
+      x = (x | (x >> 1)) & 0x3333333333333333ull;
+      x = (x | (x >> 2)) & 0x0f0f0f0f0f0f0f0full;
+      x = (x | (x >> 4)) & 0x00ff00ff00ff00ffull;
+      x = (x | (x >> 8)) & 0x0000ffff0000ffffull;
+      x = (x | (x >> 16)) & 0x00000000ffffffffull;
+
+      return x;
+    }
+
+    // The functions below are templated on the key type, an unsigned
+    // integer of 32 or 64 bits, and default to the 64-bit keys QuadTree
+    // uses. A key is never deduced from an argument, so a literal such as
+    // 4u still names a 64-bit key; pass the type to work with 32-bit keys.
+    template <typename Key>
+    using key_arg_t = std::type_identity_t<Key>;
+
+    template <typename Key = uint64_t>
+    constexpr uint8_t max_depth()
+    {
+      static_assert(std::is_unsigned_v<Key> && sizeof(Key) >= 4,
+        "Quad keys are unsigned integers of 32 or 64 bits.");
+      return static_cast<uint8_t>((8u * sizeof(Key) - 1u) / 2u);
+    }
+
+    template <typename Key = uint64_t>
+    constexpr Key min_id(uint8_t depth)
+    {
+      return Key(1) << (2 * depth);
+    }
+
+    template <typename Key = uint64_t>
+    constexpr Key max_id(uint8_t depth)
+    {
+      return min_id<Key>(depth) | (min_id<Key>(depth) - 1u);
+    }
+
+    template <typename Key = uint64_t>
+    constexpr bool is_valid(key_arg_t<Key> quad_key)
+    {
+      return quad_key != 0 && quad_key <= (Key(1) << (8 * sizeof(Key) - 1));
+    }
+
+    template <typename Key = uint64_t>
+    constexpr void compute_children(key_arg_t<Key> parent,
+      Key (&children)[4])
+    {
+      if (!is_valid<Key>(parent)) {
+        throw std::runtime_error("Invalid child of " +
+          std::to_string(parent));
+      }
+      else if (parent >= max_id<Key>(max_depth<Key>() - 1)) {
+        throw std::runtime_error("You have reached the maximum depth.");
+      }
+      for (Key i = 0; i < 4; ++i) {
+        children[i] = (parent << 2) + i;
+      }
+    }
+
+    template <typename Key = uint64_t>
+    constexpr Key compute_parent(key_arg_t<Key> child)
+    {
+      if (!is_valid<Key>(child)) {
+        throw std::runtime_error("Invalid child of " + std::to_string(child));
+      }
+      else if (child == min_id<Key>(0)) {
+        throw std::runtime_error("Root key does not have a parent.");
+      }
+      return (child & (~Key(0) >> 1)) >> 2;
+    }
+
+    // Depth of the cell a valid quad key names.
+    template <typename Key = uint64_t>
+    constexpr uint8_t key_depth(key_arg_t<Key> quad_key)
+    {
+      uint32_t high = static_cast<uint32_t>(uint64_t(quad_key) >> 32);
+      uint32_t low = static_cast<uint32_t>(quad_key);
+      uint8_t msb = high != 0 ? 32u + msb32(high) : msb32(low);
+      return msb / 2u;
+    }
+
+    // North is toward +y and east toward +x.
+    enum class Direction {
+      North,
+      South,
+      East,
+      West,
+      NorthEast,
+      NorthWest,
+      SouthEast,
+      SouthWest
+    };
+
+    constexpr int direction_dx(Direction direction)
+    {
+      switch (direction) {
+      case Direction::East:
+      case Direction::NorthEast:
+      case Direction::SouthEast:
+        return 1;
+      case Direction::West:
+      case Direction::NorthWest:
+      case Direction::SouthWest:
+        return -1;
+      default:
+        return 0;
+      }
+    }
+
+    constexpr int direction_dy(Direction direction)
+    {
+      switch (direction) {
+      case Direction::North:
+      case Direction::NorthEast:
+      case Direction::NorthWest:
+        return 1;
+      case Direction::South:
+      case Direction::SouthEast:
+      case Direction::SouthWest:
+        return -1;
+      default:
+        return 0;
+      }
+    }
+
+    // Steps the dilated coordinate under mask, the x or y bits of a Morton
+    // code, by delta without decoding it. The bits outside of mask carry
+    // the increment across the gaps. Sets out_edge instead when the step
+    // would leave the domain.
+    template <typename Key = uint64_t>
+    constexpr Key step_dilated(key_arg_t<Key> code,
+      key_arg_t<Key> mask,
+      int delta,
+      bool& out_edge)
+    {
+      Key bits = code & mask;
+      if (delta > 0) {
+        out_edge = out_edge || bits == mask;
+        return ((bits | ~mask) + 1) & mask;
+      }
+      if (delta < 0) {
+        out_edge = out_edge || bits == 0;
+        return (bits - 1) & mask;
+      }
+      return bits;
+    }
+
+    // Key of the cell next to quad_key at the same depth, or 0, which is
+    // not a valid key, when that cell is outside of the domain.
+    template <typename Key = uint64_t>
+    constexpr Key neighbour(key_arg_t<Key> quad_key, Direction direction)
+    {
+      const uint8_t depth = key_depth<Key>(quad_key);
+      const Key depth_bit = min_id<Key>(depth);
+      const Key code = quad_key & (depth_bit - 1);
+      const Key x_mask = static_cast<Key>(0x5555555555555555ull) &
+        (depth_bit - 1);
+      const Key y_mask = static_cast<Key>(0xAAAAAAAAAAAAAAAAull) &
+        (depth_bit - 1);
+
+      bool edge = false;
+      Key x = step_dilated<Key>(code, x_mask, direction_dx(direction), edge);
+      Key y = step_dilated<Key>(code, y_mask, direction_dy(direction), edge);
+      return edge ? Key(0) : depth_bit | x | y;
+    }
+
+    template <typename Key = uint64_t>
+    constexpr Key child_of(key_arg_t<Key> parent, std::size_t child_index)
+    {
+      Key children[4] = {};
+      compute_children<Key>(parent, children);
+      return children[child_index];
+    }
+
+    static_assert(msb32(1u) == 0u && msb32(2u) == 1u && msb32(3u) == 1u);
+    static_assert(msb32(0x80000000u) == 31u);
+    static_assert(spread_by_1_bit(0xffffffff) == 0x5555555555555555ull);
+    static_assert(spread_by_1_bit(0b1011) == 0b1000101);
+    static_assert(compact_by_1_bit(0x5555555555555555ll) == 0xffffffff);
+    static_assert(compact_by_1_bit(spread_by_1_bit(0x12345678)) ==
+      0x12345678);
+    static_assert(min_id(0) == 1u && min_id(1) == 4u && min_id(2) == 16u);
+    static_assert(max_id(0) == 1u && max_id(1) == 7u && max_id(2) == 31u);
+    static_assert(max_id(max_depth()) == 0x7FFFFFFFFFFFFFFFull);
+    static_assert(!is_valid(0) && is_valid(min_id(0)) &&
+      is_valid(max_id(max_depth())));
+    static_assert(child_of(min_id(0), 0) == min_id(1));
+    static_assert(child_of(min_id(0), 3) == max_id(1));
+    static_assert(child_of(max_id(4), 3) == max_id(5));
+    static_assert(compute_parent(child_of(0b100110, 2)) == 0b100110);
+    static_assert(compute_parent(min_id(1)) == min_id(0));
+    static_assert(compute_parent(max_id(max_depth())) ==
+      max_id(max_depth() - 1));
+    static_assert(key_depth(min_id(0)) == 0u && key_depth(max_id(7)) == 7u);
+    static_assert(key_depth(max_id(max_depth())) == max_depth());
+    static_assert(neighbour(min_id(0), Direction::North) == 0u);
+    static_assert(neighbour(4u, Direction::East) == 5u);
+    static_assert(neighbour(4u, Direction::North) == 6u);
+    static_assert(neighbour(4u, Direction::NorthEast) == 7u);
+    static_assert(neighbour(7u, Direction::SouthWest) == 4u);
+    static_assert(neighbour(5u, Direction::East) == 0u);
+    static_assert(neighbour(6u, Direction::North) == 0u);
+    // Across a depth 1 boundary: the upper right cell of the lower left
+    // quadrant borders the lower left cell of the upper right quadrant.
+    static_assert(neighbour(19u, Direction::NorthEast) == 28u);
+    static_assert(neighbour(19u, Direction::East) == 22u);
+    static_assert(neighbour(22u, Direction::West) == 19u);
+    static_assert(neighbour(max_id(max_depth()), Direction::East) == 0u);
+    static_assert(neighbour(max_id(max_depth()), Direction::SouthWest) ==
+      max_id(max_depth()) - 3u);
+
+    static_assert(max_depth<uint32_t>() == 15u);
+    static_assert(max_id<uint32_t>(max_depth<uint32_t>()) == 0x7FFFFFFFu);
+    static_assert(is_valid<uint32_t>(max_id<uint32_t>(15)) &&
+      !is_valid<uint32_t>(0u));
+    static_assert(child_of<uint32_t>(max_id<uint32_t>(4), 3) ==
+      max_id<uint32_t>(5));
+    static_assert(compute_parent<uint32_t>(max_id<uint32_t>(15)) ==
+      max_id<uint32_t>(14));
+    static_assert(key_depth<uint32_t>(max_id<uint32_t>(15)) == 15u);
+    static_assert(neighbour<uint32_t>(19u, Direction::NorthEast) == 28u);
+    static_assert(neighbour<uint32_t>(max_id<uint32_t>(15),
+      Direction::East) == 0u);
+  }
+}
+
+#endif
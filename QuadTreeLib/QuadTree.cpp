@@ -1,72 +1,68 @@
 #include "QuadTree.h"
+#include "ChangeLog.h"
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
 #include <cmath>
+#include <cstddef>
 #include <deque>
+#include <exception>
 #include <functional>
+#include <istream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <queue>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <xmmintrin.h>
+#define QUAD_TREE_HAS_SSE 1
+#endif
+
 namespace detail
 {
   constexpr uint32_t x_integer_space_ = 0xFFFFFFFF;
   constexpr uint32_t y_integer_space_ = 0xFFFFFFFF;
 
-  uint8_t _stdcall msb32(uint32_t x)
-  {
-    uint32_t depth = (~0u);
-    uint32_t shift = 0u;
+  typedef std::chrono::steady_clock Clock_t;
 
-    depth = (x > 0xffff) << 4;
-    x >>= depth;
-    shift = (x > 0xff) << 3;
-    x >>= shift;
-    depth |= shift;
-    shift = (x > 0xf) << 2;
-    x >>= shift;
-    depth |= shift;
-    shift = (x > 0x3) << 1;
-    x >>= shift;
-    depth |= shift;
-    shift = (x > 0x1);
-    depth |= shift;
+  std::chrono::nanoseconds elapsed_since(Clock_t::time_point start)
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      Clock_t::now() - start);
+  }
 
-    return static_cast<uint8_t>(depth);
+  uint8_t _stdcall msb32(uint32_t x)
+  {
+    return keys::msb32(x);
   }
 
   uint64_t _stdcall spread_by_1_bit(int64_t x)
   {
-    x &= 0x00000000ffffffffull;
-    x = (x | (x << 16)) & 0x0000ffff0000ffffull;
-    x = (x | (x << 8)) & 0x00ff00ff00ff00ffull;
-    x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0full;
-    x = (x | (x << 2)) & 0x3333333333333333ull;
-    x = (x | (x << 1)) & 0x5555555555555555ull;
-
-    return x;
+    return keys::spread_by_1_bit(x);
   }
 
   int64_t _stdcall compact_by_1_bit(int64_t x)
   {
-    x &= 0x5555555555555555ull;
-    x = (x | (x >> 1)) & 0x3333333333333333ull;
-    x = (x | (x >> 2)) & 0x0f0f0f0f0f0f0f0full;
-    x = (x | (x >> 4)) & 0x00ff00ff00ff00ffull;
-    x = (x | (x >> 8)) & 0x0000ffff0000ffffull;
-    x = (x | (x >> 16)) & 0x00000000ffffffffull;
-
-    return x;
+    return keys::compact_by_1_bit(x);
   }
 
   uint8_t _stdcall max_depth()
   {
-    return 31u;
+    return keys::max_depth();
   }
 
   uint32_t _stdcall max_rows(uint8_t depth)
   {
-    if (depth > max_depth()) {
+    if (depth > keys::max_depth()) {
       return 0;
     }
     if (depth == 0) {
@@ -77,7 +73,7 @@ namespace detail
 
   uint32_t _stdcall max_cols(uint8_t depth)
   {
-    if (depth > max_depth()) {
+    if (depth > keys::max_depth()) {
       return 0;
     }
     return 1 << (depth + 1);
@@ -103,8 +99,8 @@ namespace detail
       static_cast<uint64_t>(percent_y * y_integer_space_),
       static_cast<uint64_t>(max_32_bit_uint));
 
-    uint64_t xbits = spread_by_1_bit(percent_x_i);
-    uint64_t ybits = spread_by_1_bit(percent_y_i);
+    uint64_t xbits = keys::spread_by_1_bit(percent_x_i);
+    uint64_t ybits = keys::spread_by_1_bit(percent_y_i);
     uint64_t ybits_shifted = (ybits << 1);
 
     uint64_t morton = xbits | ybits_shifted;
@@ -133,62 +129,518 @@ namespace detail
 
   uint64_t _stdcall min_id(uint8_t depth)
   {
-    uint64_t depth_bit = (0x1ull << (2 * depth));
-    uint64_t ret = 0ull | depth_bit;
-    return ret;
+    return keys::min_id(depth);
   }
 
   uint64_t _stdcall max_id(uint8_t depth)
   {
-    uint64_t depth_bit = (0x1ull << (2 * depth));
-    uint64_t ret = 0ull | depth_bit;
-    ret |= (0x7FFFFFFFFFFFFFFF >> 63 - 2 * depth);
-    return ret;
+    return keys::max_id(depth);
   }
 
   bool _stdcall is_valid(uint64_t quad_key)
   {
-    bool ret = true;
-    if (quad_key == 0 || quad_key > 0x8000000000000000) {
-      ret = false;
-    }
-    return ret;
+    return keys::is_valid(quad_key);
   }
 
   void _stdcall compute_children(uint64_t parent, Children_t& children)
   {
-    if (!is_valid(parent)) {
-      throw std::runtime_error("Invalid child of " + std::to_string(parent));
+    keys::compute_children(parent, children);
+  }
+
+  uint64_t _stdcall compute_parent(uint64_t child)
+  {
+    return keys::compute_parent(child);
+  }
+
+  // "QTCK", the first bytes of a checkpoint.
+  constexpr uint32_t checkpoint_magic_ = 0x4b435451;
+  constexpr uint32_t checkpoint_version_ = 5;
+
+  // Set in a node's child mask when the node's kept child and split point
+  // follow it.
+  constexpr uint8_t checkpoint_split_flag_ = 0x10;
+
+  template <typename T>
+  void write_value(std::ostream& out, const T& value)
+  {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  template <typename T>
+  void read_value(std::istream& in, T& out_value)
+  {
+    if (!in.read(reinterpret_cast<char*>(&out_value), sizeof(T))) {
+      throw std::runtime_error("The checkpoint is truncated.");
+    }
+  }
+
+  void write_point(std::ostream& out, const Point& point)
+  {
+    write_value(out, point.id);
+    write_value(out, point.rank);
+    write_value(out, point.x);
+    write_value(out, point.y);
+  }
+
+  void read_point(std::istream& in, Point& out_point)
+  {
+    read_value(in, out_point.id);
+    read_value(in, out_point.rank);
+    read_value(in, out_point.x);
+    read_value(in, out_point.y);
+  }
+
+  // Column and row bounds of a query at depth, in key space.
+  struct KeyWindow
+  {
+    uint8_t depth;
+    uint64_t x0;
+    uint64_t x1;
+    uint64_t y0;
+    uint64_t y1;
+  };
+
+  // Cell of the descent in compute_key_ranges: either a cell at (cx, cy)
+  // on level that the window only partly covers, or a run of keys that it
+  // covers, from one or more cells.
+  struct KeyCell
+  {
+    KeyRange range;
+    uint64_t key;
+    uint8_t level;
+    uint64_t cx;
+    uint64_t cy;
+    bool partial;
+  };
+
+  // Appends cell to out_cells, merging it into the last cell when both are
+  // covered runs and it follows on from it.
+  void push_key_cell(const KeyCell& cell, std::vector<KeyCell>& out_cells)
+  {
+    if (!cell.partial && !out_cells.empty() && !out_cells.back().partial &&
+      out_cells.back().range.hi + 1 == cell.range.lo) {
+      out_cells.back().range.hi = cell.range.hi;
+    } else {
+      out_cells.push_back(cell);
+    }
+  }
+
+  // Replaces out_children with the children of cell that overlap window.
+  void split_key_cell(const KeyCell& cell,
+    const KeyWindow& window,
+    std::vector<KeyCell>& out_children)
+  {
+    out_children.clear();
+    const uint8_t level = cell.level + 1;
+    const uint8_t shift = window.depth - level;
+    for (uint64_t i : { 0, 1, 2, 3 }) {
+      const uint64_t key = (cell.key << 2) + i;
+      const uint64_t cx = (cell.cx << 1) + (i & 0x1);
+      const uint64_t cy = (cell.cy << 1) + (i >> 1);
+      const uint64_t lx = cx << shift;
+      const uint64_t hx = ((cx + 1) << shift) - 1;
+      const uint64_t ly = cy << shift;
+      const uint64_t hy = ((cy + 1) << shift) - 1;
+      if (hx < window.x0 || lx > window.x1 || hy < window.y0 ||
+        ly > window.y1) {
+        continue;
+      }
+      const bool covered = lx >= window.x0 && hx <= window.x1 &&
+        ly >= window.y0 && hy <= window.y1;
+      const KeyRange range = {
+        key << (2u * shift), ((key + 1) << (2u * shift)) - 1
+      };
+      out_children.push_back({ range, key, level, cx, cy, !covered });
+    }
+  }
+
+  void _stdcall compute_key_ranges(const Rect& rect,
+    const Rect& bounds,
+    uint8_t depth,
+    std::size_t max_ranges,
+    std::vector<KeyRange>& out_ranges)
+  {
+    if (depth > keys::max_depth()) {
+      throw std::runtime_error("Depth " + std::to_string(depth) +
+        " is deeper than the maximum depth.");
     }
-    else if (parent >= max_id(max_depth() - 1)) {
-      throw std::runtime_error("You have reached the maximum depth.");
+
+    out_ranges.clear();
+    const Rect clipped = {
+      (std::max)(rect.lx, bounds.lx), (std::max)(rect.ly, bounds.ly),
+      (std::min)(rect.hx, bounds.hx), (std::min)(rect.hy, bounds.hy)
+    };
+    if (clipped.lx > clipped.hx || clipped.ly > clipped.hy) {
+      return;
+    }
+
+    // Keys grow with x and y, so the corner keys bound the columns and rows
+    // of every point inside rect under compute_quad_key's own rounding.
+    const uint64_t code_mask = keys::min_id(depth) - 1;
+    const uint64_t low = compute_quad_key(
+      { 0, 0, clipped.lx, clipped.ly }, depth, bounds) & code_mask;
+    const uint64_t high = compute_quad_key(
+      { 0, 0, clipped.hx, clipped.hy }, depth, bounds) & code_mask;
+    const KeyWindow window = {
+      depth,
+      static_cast<uint64_t>(keys::compact_by_1_bit(low)),
+      static_cast<uint64_t>(keys::compact_by_1_bit(high)),
+      static_cast<uint64_t>(keys::compact_by_1_bit(low >> 1)),
+      static_cast<uint64_t>(keys::compact_by_1_bit(high >> 1))
+    };
+    const uint64_t last = (uint64_t(1) << depth) - 1;
+    const bool whole = window.x0 == 0 && window.y0 == 0 &&
+      window.x1 == last && window.y1 == last;
+
+    // Partly covered cells are split a level at a time, in key order, as
+    // long as the cells so far, the split one's children and the cells
+    // still to come fit in max_ranges. A cell that does not fit is kept
+    // whole, as every later split only adds cells, so the descent costs
+    // O(depth * max_ranges) however long the rect's boundary is at depth.
+    std::vector<KeyCell> cells = {
+      { { keys::min_id(depth), keys::max_id(depth) }, keys::min_id(0), 0,
+        0, 0, !whole }
+    };
+    std::vector<KeyCell> next;
+    std::vector<KeyCell> children;
+    for (bool split = true; split;) {
+      split = false;
+      next.clear();
+      for (std::size_t i = 0; i < cells.size(); ++i) {
+        const KeyCell& cell = cells[i];
+        if (cell.partial && cell.level < depth) {
+          split_key_cell(cell, window, children);
+          const std::size_t later = cells.size() - i - 1;
+          if (max_ranges == 0 ||
+            next.size() + children.size() + later <= max_ranges) {
+            for (const KeyCell& child : children) {
+              push_key_cell(child, next);
+            }
+            split = true;
+            continue;
+          }
+        }
+        push_key_cell(cell, next);
+      }
+      cells.swap(next);
     }
-    for (std::size_t i : {0, 1, 2, 3}) {
-      children[i] = (parent << 2) + i;
+
+    for (const KeyCell& cell : cells) {
+      if (!out_ranges.empty() && out_ranges.back().hi + 1 == cell.range.lo) {
+        out_ranges.back().hi = cell.range.hi;
+      } else {
+        out_ranges.push_back(cell.range);
+      }
     }
   }
 
-  uint64_t _stdcall compute_parent(uint64_t child)
+  bool rects_within(const Rect& a, const Rect& b, float distance)
+  {
+    float slack = rect_slack(a, b);
+    float dx = (std::max)({ 0.0f, a.lx - b.hx, b.lx - a.hx });
+    float dy = (std::max)({ 0.0f, a.ly - b.hy, b.ly - a.hy });
+    dx = (std::max)(0.0f, dx - slack);
+    dy = (std::max)(0.0f, dy - slack);
+    return (dx * dx + dy * dy) <= distance * distance;
+  }
+
+  // Runs task(index, thread) for every index in [0, count) on up to
+  // thread_count threads, the calling thread included. The first exception
+  // thrown by any task is rethrown once all threads have joined.
+  void parallel_for(std::size_t count,
+    std::size_t thread_count,
+    const std::function<void(std::size_t, std::size_t)>& task)
+  {
+    thread_count = (std::max)(static_cast<std::size_t>(1),
+      (std::min)(thread_count, count));
+
+    std::atomic<std::size_t> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto worker = [&](std::size_t thread)
+    {
+      try {
+        for (std::size_t i = next++; i < count; i = next++) {
+          task(i, thread);
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+        next = count;
+      }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count - 1);
+    for (std::size_t t = 1; t < thread_count; ++t) {
+      threads.emplace_back(worker, t);
+    }
+    worker(0);
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  // Calls visit(j) for every j in [begin, end) whose (xs[j], ys[j]) lies
+  // within radius_sq of (x, y), in order, until visit returns false. Four
+  // distances are compared at a time where SSE is available.
+  template <typename Visit>
+  void visit_within(const float* xs,
+    const float* ys,
+    std::size_t begin,
+    std::size_t end,
+    float x,
+    float y,
+    float radius_sq,
+    Visit visit)
+  {
+    std::size_t j = begin;
+#ifdef QUAD_TREE_HAS_SSE
+    const __m128 px = _mm_set1_ps(x);
+    const __m128 py = _mm_set1_ps(y);
+    const __m128 r = _mm_set1_ps(radius_sq);
+    for (; j + 4 <= end; j += 4) {
+      __m128 dx = _mm_sub_ps(_mm_loadu_ps(xs + j), px);
+      __m128 dy = _mm_sub_ps(_mm_loadu_ps(ys + j), py);
+      __m128 d = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+      unsigned mask = static_cast<unsigned>(
+        _mm_movemask_ps(_mm_cmple_ps(d, r)));
+      while (mask != 0) {
+        if (!visit(j + std::countr_zero(mask))) {
+          return;
+        }
+        mask &= mask - 1;
+      }
+    }
+#endif
+    for (; j < end; ++j) {
+      float dx = xs[j] - x;
+      float dy = ys[j] - y;
+      if (dx * dx + dy * dy <= radius_sq && !visit(j)) {
+        return;
+      }
+    }
+  }
+
+  // Root of i in a union-find forest shared between threads, halving the
+  // path on the way.
+  std::size_t find_root(std::vector<std::atomic<std::size_t>>& parents,
+    std::size_t i)
+  {
+    std::size_t parent = parents[i].load(std::memory_order_relaxed);
+    while (parent != i) {
+      std::size_t grandparent = parents[parent].load(
+        std::memory_order_relaxed);
+      parents[i].compare_exchange_weak(parent, grandparent,
+        std::memory_order_relaxed);
+      i = parent;
+      parent = parents[i].load(std::memory_order_relaxed);
+    }
+    return i;
+  }
+
+  // Merges the sets of a and b. The larger root is linked below the smaller
+  // one, and only while it is still a root, so concurrent unions never
+  // create a cycle.
+  void unite_roots(std::vector<std::atomic<std::size_t>>& parents,
+    std::size_t a,
+    std::size_t b)
+  {
+    while (true) {
+      a = find_root(parents, a);
+      b = find_root(parents, b);
+      if (a == b) {
+        return;
+      }
+      if (a < b) {
+        std::swap(a, b);
+      }
+      std::size_t expected = a;
+      if (parents[a].compare_exchange_strong(expected, b,
+        std::memory_order_relaxed)) {
+        return;
+      }
+    }
+  }
+
+  // Narrows [out_enter, out_exit] to the part of the segment from
+  // (x0, y0) along (dx, dy), parameterized from 0 to 1, that lies inside
+  // box. Returns false when no part of it does.
+  bool clip_segment(const Rect& box,
+    float x0,
+    float y0,
+    float dx,
+    float dy,
+    float& out_enter,
+    float& out_exit)
+  {
+    float enter = 0.0f;
+    float exit = 1.0f;
+    auto clip = [&](float origin, float delta, float lo, float hi)
+      {
+        if (delta == 0.0f) {
+          return origin >= lo && origin <= hi;
+        }
+        float t0 = (lo - origin) / delta;
+        float t1 = (hi - origin) / delta;
+        if (t0 > t1) {
+          std::swap(t0, t1);
+        }
+        enter = (std::max)(enter, t0);
+        exit = (std::min)(exit, t1);
+        return enter <= exit;
+      };
+    if (!clip(x0, dx, box.lx, box.hx) || !clip(y0, dy, box.ly, box.hy)) {
+      return false;
+    }
+    out_enter = enter;
+    out_exit = exit;
+    return true;
+  }
+
+  // Inputs at or below this many points are reduced on the calling thread.
+  constexpr std::size_t bounds_chunk_size_ = 1ull << 18;
+
+  // Key of the same cell once its tree has gained a new root above the old
+  // one, with the old root in the given quadrant of the new root.
+  uint64_t prefix_key(uint64_t quad_key, uint8_t quadrant)
+  {
+    uint8_t depth = keys::key_depth(quad_key);
+    if (depth >= keys::max_depth()) {
+      throw std::runtime_error("The tree has grown past the maximum depth.");
+    }
+    uint64_t path = quad_key ^ keys::min_id(depth);
+    return keys::min_id(depth + 1) |
+      (static_cast<uint64_t>(quadrant) << (2u * depth)) | path;
+  }
+
+  Rect empty_bounds()
+  {
+    const float max_float = (std::numeric_limits<float>::max)();
+    return { +max_float, +max_float, -max_float, -max_float };
+  }
+
+  // Splits [0, count) into chunks, runs reduce_chunk(first, last, bounds)
+  // on each, in parallel when there is more than one, and merges the
+  // per-chunk bounds into out_rect.
+  template <typename ReduceChunk>
+  void reduce_bounds(std::size_t count, Rect& out_rect,
+    ReduceChunk reduce_chunk)
+  {
+    std::size_t chunk_count = (std::max)(static_cast<std::size_t>(1),
+      (count + bounds_chunk_size_ - 1) / bounds_chunk_size_);
+    std::size_t chunk_size = (count + chunk_count - 1) / chunk_count;
+
+    std::vector<Rect> chunks(chunk_count, empty_bounds());
+    auto reduce = [&](std::size_t chunk, std::size_t)
+    {
+      std::size_t first = chunk * chunk_size;
+      std::size_t last = (std::min)(count, first + chunk_size);
+      reduce_chunk(first, last, chunks[chunk]);
+    };
+    if (chunk_count == 1) {
+      reduce(0, 0);
+    } else {
+      parallel_for(chunk_count, std::thread::hardware_concurrency(), reduce);
+    }
+
+    out_rect = empty_bounds();
+    for (const Rect& chunk : chunks) {
+      out_rect.lx = (std::min)(out_rect.lx, chunk.lx);
+      out_rect.ly = (std::min)(out_rect.ly, chunk.ly);
+      out_rect.hx = (std::max)(out_rect.hx, chunk.hx);
+      out_rect.hy = (std::max)(out_rect.hy, chunk.hy);
+    }
+  }
+
+  // Grows bounds to cover count contiguous points. With SSE each point's x
+  // and y are loaded as one 64-bit lane, so a register holds x0 y0 x1 y1
+  // and one min and one max cover two points. The new value is the first
+  // operand so a NaN coordinate is skipped, as in the scalar comparisons.
+  void expand_bounds(const Point* points, std::size_t count, Rect& bounds)
   {
-    if (!is_valid(child)) {
-      throw std::runtime_error("Invalid child of " + std::to_string(child));
+    std::size_t i = 0;
+    float minX = bounds.lx;
+    float minY = bounds.ly;
+    float maxX = bounds.hx;
+    float maxY = bounds.hy;
+
+#ifdef QUAD_TREE_HAS_SSE
+    const char* xy = reinterpret_cast<const char*>(points) +
+      offsetof(Point, x);
+    auto load_xy2 = [&](std::size_t index)
+    {
+      const char* first = xy + index * sizeof(Point);
+      __m128 v = _mm_loadl_pi(_mm_setzero_ps(),
+        reinterpret_cast<const __m64*>(first));
+      return _mm_loadh_pi(v,
+        reinterpret_cast<const __m64*>(first + sizeof(Point)));
+    };
+
+    __m128 lo0 = _mm_setr_ps(minX, minY, minX, minY);
+    __m128 hi0 = _mm_setr_ps(maxX, maxY, maxX, maxY);
+    __m128 lo1 = lo0;
+    __m128 hi1 = hi0;
+    for (; i + 4 <= count; i += 4) {
+      __m128 v0 = load_xy2(i);
+      __m128 v1 = load_xy2(i + 2);
+      lo0 = _mm_min_ps(v0, lo0);
+      hi0 = _mm_max_ps(v0, hi0);
+      lo1 = _mm_min_ps(v1, lo1);
+      hi1 = _mm_max_ps(v1, hi1);
     }
-    else if (child == min_id(0)) {
-      throw std::runtime_error("Root key does not have a parent.");
+    __m128 lo = _mm_min_ps(lo0, lo1);
+    __m128 hi = _mm_max_ps(hi0, hi1);
+    lo = _mm_min_ps(lo, _mm_movehl_ps(lo, lo));
+    hi = _mm_max_ps(hi, _mm_movehl_ps(hi, hi));
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, lo);
+    minX = lanes[0];
+    minY = lanes[1];
+    _mm_storeu_ps(lanes, hi);
+    maxX = lanes[0];
+    maxY = lanes[1];
+#endif
+
+    for (; i < count; ++i) {
+      const Point& p = points[i];
+      if (p.x < minX) minX = p.x;
+      if (p.x > maxX) maxX = p.x;
+      if (p.y < minY) minY = p.y;
+      if (p.y > maxY) maxY = p.y;
     }
-    child = child & 0x7FFFFFFFFFFFFFFF;
-    uint64_t parent = child >> 2;
-    return parent;
+
+    bounds = { minX, minY, maxX, maxY };
   }
 }
 
-QuadTree::Node::Node(uint64_t quad_key) :
+QuadTree::Node::Node(uint64_t quad_key, uint8_t key_epoch) :
   quad_key_(quad_key),
-  children_()
-{}
+  key_epoch_(key_epoch),
+  summary_(),
+  children_(),
+  has_split_(false),
+  kept_child_(0),
+  split_x_(0.0f),
+  split_y_(0.0f)
+{
+  summary_.oldest_generation = NO_EXPIRY;
+}
 
 QuadTree::Node::~Node()
-{}
+{
+  for (Node* child : children_) {
+    delete child;
+  }
+}
 
 void QuadTree::Node::set_data(
   std::vector<detail::Point*>::iterator begin,
@@ -211,19 +663,105 @@ void QuadTree::Node::set_child(const ChildId id, Node* child)
   children_[static_cast<std::uint8_t>(id)] = child;
 }
 
+bool QuadTree::Node::is_leaf() const
+{
+  return children_[0] == nullptr && children_[1] == nullptr &&
+    children_[2] == nullptr && children_[3] == nullptr;
+}
+
+void QuadTree::Node::summarize()
+{
+  summary_ = {};
+  summary_.oldest_generation = NO_EXPIRY;
+  if (is_leaf()) {
+    for (const detail::Point& p : points_) {
+      add_to_summary(p);
+    }
+    if (!groups_.empty()) {
+      summary_.oldest_generation = groups_.front().generation;
+    }
+    return;
+  }
+
+  for (const Node* child : children_) {
+    if (child == nullptr) {
+      continue;
+    }
+    summary_.height = (std::max)(summary_.height,
+      static_cast<uint8_t>(child->summary_.height + 1));
+    if (child->summary_.count == 0) {
+      continue;
+    }
+    const Summary& other = child->summary_;
+    if (summary_.count == 0 || other.top.rank > summary_.top.rank) {
+      summary_.top = other.top;
+    }
+    summary_.count += other.count;
+    summary_.sum_x += other.sum_x;
+    summary_.sum_y += other.sum_y;
+    summary_.oldest_generation = (std::min)(summary_.oldest_generation,
+      other.oldest_generation);
+  }
+}
+
+void QuadTree::Node::add_to_summary(const detail::Point& point)
+{
+  if (summary_.count == 0 || point.rank > summary_.top.rank) {
+    summary_.top = point;
+  }
+  ++summary_.count;
+  summary_.sum_x += point.x;
+  summary_.sum_y += point.y;
+}
+
 QuadTree::QuadTree(
   std::vector<detail::Point*>::iterator begin,
-  std::vector<detail::Point*>::iterator end) :
+  std::vector<detail::Point*>::iterator end,
+  BuildMode mode) :
   root_(nullptr),
-  global_bounds_({})
+  global_bounds_({}),
+  build_timings_({}),
+  growth_directions_(),
+  change_log_(nullptr),
+  mutation_count_(0),
+  id_index_enabled_(false),
+  id_index_(),
+  generation_span_(1)
 {
   if (begin == end) {
     return;
   }
 
+  auto start = detail::Clock_t::now();
   compute_bounds(begin, end, global_bounds_);
+  build_timings_.bounds = detail::elapsed_since(start);
+
   root_ = new Node(detail::compute_quad_key(**begin, 0u, global_bounds_));
-  build_tree(root_, begin, end, 0u);
+  if (mode == BuildMode::InPlace) {
+    build_tree_in_place(root_, begin, end, 0u);
+  } else {
+    build_tree(root_, begin, end, 0u);
+  }
+}
+
+QuadTree::QuadTree(QuadTree&& other) :
+  root_(other.root_),
+  global_bounds_(other.global_bounds_),
+  build_timings_(other.build_timings_),
+  growth_directions_(std::move(other.growth_directions_)),
+  change_log_(other.change_log_),
+  mutation_count_(0),
+  id_index_enabled_(other.id_index_enabled_),
+  id_index_(std::move(other.id_index_)),
+  generation_span_(other.generation_span_)
+{
+  other.root_ = nullptr;
+  other.global_bounds_ = {};
+  other.growth_directions_.clear();
+  other.change_log_ = nullptr;
+  other.id_index_enabled_ = false;
+  other.id_index_.clear();
+  ++other.mutation_count_;
 }
 
 QuadTree::~QuadTree()
@@ -231,6 +769,92 @@ QuadTree::~QuadTree()
   delete root_;
 }
 
+QuadTree QuadTree::merge(QuadTree&& lhs, QuadTree&& rhs)
+{
+  auto expiring = [](const QuadTree& tree)
+    {
+      return tree.root_ != nullptr &&
+        tree.root_->summary_.oldest_generation != NO_EXPIRY;
+    };
+  if (expiring(lhs) && expiring(rhs) &&
+    lhs.generation_span_ != rhs.generation_span_) {
+    throw std::runtime_error("Cannot merge trees whose expiring points have "
+      "different generation spans.");
+  }
+  const uint64_t span = expiring(rhs) ? rhs.generation_span_ :
+    lhs.generation_span_;
+
+  const detail::Rect& a = lhs.global_bounds_;
+  const detail::Rect& b = rhs.global_bounds_;
+  if (rhs.root_ == nullptr || (lhs.root_ != nullptr &&
+    a.lx == b.lx && a.ly == b.ly && a.hx == b.hx && a.hy == b.hy &&
+    same_splits(lhs.root_, rhs.root_))) {
+    QuadTree merged(std::move(lhs));
+    merged.change_log_ = nullptr;
+    merged.set_id_index(false);
+    merged.generation_span_ = span;
+    if (rhs.root_ != nullptr) {
+      merged.root_ = merged.merge_nodes(merged.root_, rhs.root_,
+        merged.global_bounds_, detail::keys::min_id(0), 0u);
+      rhs.root_ = nullptr;
+    }
+    rhs.global_bounds_ = {};
+    rhs.growth_directions_.clear();
+    rhs.id_index_.clear();
+    ++rhs.mutation_count_;
+    return merged;
+  }
+  if (lhs.root_ == nullptr) {
+    return merge(std::move(rhs), std::move(lhs));
+  }
+
+  detail::Rect bounds = {
+    (std::min)(a.lx, b.lx), (std::min)(a.ly, b.ly),
+    (std::max)(a.hx, b.hx), (std::max)(a.hy, b.hy)
+  };
+  std::vector<KeyedPoint_t> runs[2];
+  QuadTree* trees[2] = { &lhs, &rhs };
+  for (std::size_t t = 0; t < 2; ++t) {
+    std::vector<AgedPoint_t> items;
+    subtree_items(trees[t]->root_, items);
+    runs[t].reserve(items.size());
+    for (const AgedPoint_t& item : items) {
+      runs[t].emplace_back(detail::compute_quad_key(item.second,
+        detail::keys::max_depth(), bounds), item);
+    }
+    std::sort(runs[t].begin(), runs[t].end(),
+      [](const KeyedPoint_t& x, const KeyedPoint_t& y)
+      {
+        return x.first < y.first;
+      });
+  }
+  std::vector<KeyedPoint_t> keyed;
+  keyed.reserve(runs[0].size() + runs[1].size());
+  std::merge(runs[0].begin(), runs[0].end(), runs[1].begin(), runs[1].end(),
+    std::back_inserter(keyed),
+    [](const KeyedPoint_t& x, const KeyedPoint_t& y)
+    {
+      return x.first < y.first;
+    });
+
+  std::vector<detail::Point*> none;
+  QuadTree merged(none.begin(), none.end());
+  merged.global_bounds_ = bounds;
+  merged.generation_span_ = span;
+  merged.root_ = new Node(detail::keys::min_id(0));
+  merged.build_sorted(merged.root_, keyed.begin(), keyed.end(), 0u);
+
+  for (QuadTree* tree : trees) {
+    delete tree->root_;
+    tree->root_ = nullptr;
+    tree->global_bounds_ = {};
+    tree->growth_directions_.clear();
+    tree->id_index_.clear();
+    ++tree->mutation_count_;
+  }
+  return merged;
+}
+
 const detail::Rect& QuadTree::global_bounds() const
 {
   return global_bounds_;
@@ -241,92 +865,2161 @@ void QuadTree::compute_bounds(
     std::vector<detail::Point*>::iterator end,
     detail::Rect& out_rect)
 {
-  float maxY = -(std::numeric_limits<float>::max)();
-  float minY = +(std::numeric_limits<float>::max)();
-  float maxX = -(std::numeric_limits<float>::max)();
-  float minX = +(std::numeric_limits<float>::max)();
-
-  std::for_each(begin, end,
-    [&](const detail::Point* it)
+  detail::reduce_bounds(std::distance(begin, end), out_rect,
+    [&](std::size_t first, std::size_t last, detail::Rect& out_chunk)
     {
-      if (it->x < minX) minX = it->x;
-      if (it->x > maxX) maxX = it->x;
-      if (it->y < minY) minY = it->y;
-      if (it->y > maxY) maxY = it->y;
-      int x = 0;
+      float maxY = out_chunk.hy;
+      float minY = out_chunk.ly;
+      float maxX = out_chunk.hx;
+      float minX = out_chunk.lx;
+
+      std::for_each(begin + first, begin + last,
+        [&](const detail::Point* it)
+        {
+          if (it->x < minX) minX = it->x;
+          if (it->x > maxX) maxX = it->x;
+          if (it->y < minY) minY = it->y;
+          if (it->y > maxY) maxY = it->y;
+        });
+
+      out_chunk = { minX, minY, maxX, maxY };
     });
+}
 
-  out_rect = { minX, minY, maxX, maxY };
+void QuadTree::compute_bounds(
+    std::span<const detail::Point> points,
+    detail::Rect& out_rect)
+{
+  detail::reduce_bounds(points.size(), out_rect,
+    [&](std::size_t first, std::size_t last, detail::Rect& out_chunk)
+    {
+      detail::expand_bounds(points.data() + first, last - first, out_chunk);
+    });
 }
 
 uint8_t QuadTree::max_depth() const
 {
-  return max_depth_recursive(root_);
+  // An empty tree has always reported one level less than a lone leaf.
+  return root_ == nullptr ? static_cast<uint8_t>(-1) :
+    root_->summary_.height;
 }
 
-void QuadTree::build_tree(Node* node, 
-  std::vector<detail::Point*>::iterator begin,
-  std::vector<detail::Point*>::iterator end,
-  uint8_t depth)
+void QuadTree::insert(const detail::Point& point)
 {
-  auto count = std::distance(begin, end);
+  add(point, NO_EXPIRY);
+}
 
-  if (node == nullptr || count == 0) {
-    return;
+void QuadTree::insert(const detail::Point& point, uint64_t expires_at)
+{
+  add(point, expires_at / generation_span_);
+}
+
+std::size_t QuadTree::expire(uint64_t now)
+{
+  // Generation g holds expiry times up to (g + 1) * span - 1, so it has
+  // expired once that is at or before now.
+  uint64_t first_live = now / generation_span_;
+  if (now % generation_span_ == generation_span_ - 1) {
+    first_live = first_live == NO_EXPIRY ? NO_EXPIRY : first_live + 1;
+  }
+  if (root_ == nullptr || root_->summary_.oldest_generation >= first_live) {
+    return 0;
   }
 
-  if (count <= MAX_BLOCK_SIZE || depth == detail::max_depth()) {
-    node->set_data(begin, end);
-  } else {
-    const detail::Point& ip = **begin;
-    uint64_t p_pid = detail::compute_quad_key(ip, depth, global_bounds_);
-    detail::Children_t children;
-    detail::compute_children(p_pid, children);
-    std::pair<uint64_t, std::vector<detail::Point*>> buckets[4];
-    buckets[0] = std::make_pair(children[0], std::vector<detail::Point*>());
-    buckets[1] = std::make_pair(children[1], std::vector<detail::Point*>());
-    buckets[2] = std::make_pair(children[2], std::vector<detail::Point*>());
-    buckets[3] = std::make_pair(children[3], std::vector<detail::Point*>());
-
-    const uint64_t min_id = buckets[0].first;
-    std::vector<detail::Point*>::iterator it = begin;
-    while (it != end) {
-      detail::Point& p = **it;
-      uint64_t c_pid = detail::compute_quad_key(p, depth + 1, global_bounds_);
+  ++mutation_count_;
+  std::size_t removed = expire_recursive(root_, first_live);
+  if (change_log_ != nullptr) {
+    change_log_->append_expire(first_live);
+  }
+  return removed;
+}
 
-      uint64_t expected_parent = detail::compute_parent(c_pid);
-      if (expected_parent != node->quad_key_) {
-        throw std::runtime_error("A quadkey got bucketed wrong.");
-      }
+void QuadTree::set_generation_span(uint64_t span)
+{
+  if (span == 0) {
+    throw std::runtime_error("A generation must span at least one unit.");
+  }
+  if (root_ != nullptr && root_->summary_.oldest_generation != NO_EXPIRY) {
+    throw std::runtime_error("Cannot change the generation span of a tree "
+      "that holds expiring points.");
+  }
+  generation_span_ = span;
+}
 
-      std::size_t bucket_index = c_pid - min_id;
-      buckets[bucket_index].second.push_back(&p);
-      ++it;
+uint64_t QuadTree::generation_span() const
+{
+  return generation_span_;
+}
+
+void QuadTree::add(const detail::Point& point, uint64_t generation)
+{
+  ++mutation_count_;
+  if (!std::isfinite(point.x) || !std::isfinite(point.y)) {
+    throw std::runtime_error("Cannot insert a point that is not finite.");
+  }
+  if (id_index_enabled_ && id_index_.count(point.id) != 0) {
+    throw std::runtime_error("A point with this id is already in the tree.");
+  }
+
+  if (root_ == nullptr) {
+    global_bounds_ = {
+      point.x - 0.5f, point.y - 0.5f, point.x + 0.5f, point.y + 0.5f
+    };
+    root_ = new Node(detail::keys::min_id(0),
+      static_cast<uint8_t>(growth_directions_.size()));
+    if (change_log_ != nullptr) {
+      change_log_->append_root(global_bounds_);
     }
+  }
 
-    for (std::size_t i = 0; i < 4; ++i) {
-      if (!buckets[i].second.empty()) {
-        node->children_[i] = new Node(buckets[i].first);
-        build_tree(
-          node->children_[i],
-          buckets[i].second.begin(),
-          buckets[i].second.end(),
-          depth + 1);
-      }
+  while (!detail::contains(global_bounds_, point)) {
+    grow_toward(point);
+  }
+
+  const uint64_t key = placement_key(point);
+  detail::Rect cell;
+  Node* leaf = insert_at(key, point, generation, cell);
+  if (change_log_ != nullptr) {
+    if (generation == NO_EXPIRY) {
+      change_log_->append_insert(key, point);
+    } else {
+      change_log_->append_insert_expiring(key, point, generation);
     }
   }
+  split_if_full(leaf, cell, key);
 }
 
-int8_t QuadTree::max_depth_recursive(const Node* node) const
+bool QuadTree::erase(const detail::Point& point)
 {
-  if (node == nullptr) {
-    return -1;
-  } else {
-    auto depth0 = max_depth_recursive(node->children_[0]);
-    auto depth1 = max_depth_recursive(node->children_[1]);
-    auto depth2 = max_depth_recursive(node->children_[2]);
-    auto depth3 = max_depth_recursive(node->children_[3]);
-    std::vector<int8_t> depths = { depth0, depth1, depth2, depth3 };
-    return 1 + *(std::max_element(depths.begin(), depths.end()));
+  const uint64_t key = locate(point);
+  uint64_t generation = NO_EXPIRY;
+  if (key == 0 || !erase_at(key, point, generation)) {
+    return false;
+  }
+  ++mutation_count_;
+  if (change_log_ != nullptr) {
+    change_log_->append_erase(key, point);
+  }
+  return true;
+}
+
+bool QuadTree::move(const detail::Point& point, float x, float y)
+{
+  ++mutation_count_;
+  if (!std::isfinite(x) || !std::isfinite(y)) {
+    throw std::runtime_error("Cannot move a point to a position that is "
+      "not finite.");
+  }
+
+  uint64_t from_key = locate(point);
+  if (from_key == 0) {
+    return false;
+  }
+
+  detail::Point moved = point;
+  moved.x = x;
+  moved.y = y;
+  const std::size_t epoch = growth_directions_.size();
+  while (!detail::contains(global_bounds_, moved)) {
+    grow_toward(moved);
+  }
+  for (std::size_t i = epoch; i < growth_directions_.size(); ++i) {
+    from_key = detail::prefix_key(from_key, growth_directions_[i]);
+  }
+
+  uint64_t generation = NO_EXPIRY;
+  erase_at(from_key, point, generation);
+  const uint64_t to_key = placement_key(moved);
+  detail::Rect cell;
+  Node* leaf = insert_at(to_key, moved, generation, cell);
+  if (change_log_ != nullptr) {
+    change_log_->append_move(from_key, point, to_key, x, y);
+  }
+  split_if_full(leaf, cell, to_key);
+  return true;
+}
+
+void QuadTree::set_change_log(ChangeLog* log)
+{
+  change_log_ = log;
+}
+
+void QuadTree::set_id_index(bool enabled)
+{
+  IdIndex_t index;
+  id_index_enabled_ = false;
+  id_index_.clear();
+  if (enabled && root_ != nullptr) {
+    index_subtree(root_, index);
+  }
+  id_index_.swap(index);
+  id_index_enabled_ = enabled;
+}
+
+bool QuadTree::has_id_index() const
+{
+  return id_index_enabled_;
+}
+
+bool QuadTree::find(int64_t id, detail::Point& out_point) const
+{
+  if (!id_index_enabled_) {
+    throw std::runtime_error("The tree has no id index.");
+  }
+  auto it = id_index_.find(id);
+  if (it == id_index_.end()) {
+    return false;
+  }
+  out_point = it->second.leaf->points_[it->second.index];
+  return true;
+}
+
+bool QuadTree::erase(int64_t id)
+{
+  detail::Point point;
+  return find(id, point) && erase(point);
+}
+
+bool QuadTree::move(int64_t id, float x, float y)
+{
+  detail::Point point;
+  return find(id, point) && move(point, x, y);
+}
+
+void QuadTree::apply_log(std::span<const uint8_t> records)
+{
+  ++mutation_count_;
+  ChangeLog::Record record;
+  std::size_t offset = 0;
+  while (offset < records.size()) {
+    const std::size_t next = ChangeLog::decode(records, offset, record);
+    detail::Rect cell;
+    switch (record.op) {
+    case ChangeLog::Op::Root:
+      delete root_;
+      root_ = nullptr;
+      id_index_.clear();
+      growth_directions_.clear();
+      global_bounds_ = record.bounds;
+      root_ = new Node(detail::keys::min_id(0));
+      break;
+    case ChangeLog::Op::Grow:
+      if (root_ == nullptr) {
+        throw std::runtime_error("The change log does not match the tree.");
+      }
+      grow(record.quadrant, record.bounds);
+      break;
+    case ChangeLog::Op::Insert:
+      if (root_ == nullptr) {
+        throw std::runtime_error("The change log does not match the tree.");
+      }
+      insert_at(record.key, record.point, NO_EXPIRY, cell);
+      break;
+    case ChangeLog::Op::InsertExpiring:
+      if (root_ == nullptr || record.generation == NO_EXPIRY) {
+        throw std::runtime_error("The change log does not match the tree.");
+      }
+      insert_at(record.key, record.point, record.generation, cell);
+      break;
+    case ChangeLog::Op::Erase: {
+      uint64_t generation = NO_EXPIRY;
+      if (!erase_at(record.key, record.point, generation)) {
+        throw std::runtime_error("The change log does not match the tree.");
+      }
+      break;
+    }
+    case ChangeLog::Op::Move: {
+      uint64_t generation = NO_EXPIRY;
+      if (!erase_at(record.key, record.point, generation)) {
+        throw std::runtime_error("The change log does not match the tree.");
+      }
+      detail::Point moved = record.point;
+      moved.x = record.x;
+      moved.y = record.y;
+      insert_at(record.to_key, moved, generation, cell);
+      break;
+    }
+    case ChangeLog::Op::Expire:
+      if (root_ == nullptr) {
+        throw std::runtime_error("The change log does not match the tree.");
+      }
+      expire_recursive(root_, record.generation);
+      break;
+    case ChangeLog::Op::Split: {
+      uint64_t found_key = 0;
+      Node* leaf = const_cast<Node*>(find_node(record.key, found_key));
+      if (leaf == nullptr || found_key != record.key || !leaf->is_leaf()) {
+        throw std::runtime_error("The change log does not match the tree.");
+      }
+      const uint8_t depth = detail::keys::key_depth(record.key);
+      split_leaf(leaf, key_cell(record.key), depth);
+      raise_heights(record.key);
+      break;
+    }
+    }
+    if (change_log_ != nullptr) {
+      change_log_->append_encoded(records.subspan(offset, next - offset));
+    }
+    offset = next;
+  }
+}
+
+void QuadTree::write_checkpoint(std::ostream& out) const
+{
+  detail::write_value(out, detail::checkpoint_magic_);
+  detail::write_value(out, detail::checkpoint_version_);
+  detail::write_value(out, global_bounds_);
+  detail::write_value(out, static_cast<uint32_t>(growth_directions_.size()));
+  for (uint8_t quadrant : growth_directions_) {
+    detail::write_value(out, quadrant);
+  }
+  detail::write_value(out, generation_span_);
+  detail::write_value(out, static_cast<uint8_t>(root_ != nullptr));
+  if (root_ != nullptr) {
+    write_node(out, root_);
+  }
+  if (!out) {
+    throw std::runtime_error("Could not write the checkpoint.");
+  }
+}
+
+void QuadTree::read_checkpoint(std::istream& in)
+{
+  uint32_t magic = 0;
+  uint32_t version = 0;
+  detail::read_value(in, magic);
+  detail::read_value(in, version);
+  if (magic != detail::checkpoint_magic_ ||
+    version != detail::checkpoint_version_) {
+    throw std::runtime_error("Not a QuadTree checkpoint.");
+  }
+
+  detail::Rect bounds;
+  uint32_t growth_count = 0;
+  detail::read_value(in, bounds);
+  detail::read_value(in, growth_count);
+  if (growth_count > detail::keys::max_depth()) {
+    throw std::runtime_error("The checkpoint is corrupt.");
+  }
+  std::vector<uint8_t> growth_directions(growth_count);
+  for (uint8_t& quadrant : growth_directions) {
+    detail::read_value(in, quadrant);
+  }
+  uint64_t generation_span = 0;
+  detail::read_value(in, generation_span);
+  if (generation_span == 0) {
+    throw std::runtime_error("The checkpoint is corrupt.");
+  }
+  uint8_t has_root = 0;
+  detail::read_value(in, has_root);
+  std::unique_ptr<Node> root;
+  if (has_root != 0) {
+    root.reset(read_node(in, detail::keys::min_id(0), 0u,
+      static_cast<uint8_t>(growth_count)));
+  }
+  IdIndex_t index;
+  if (id_index_enabled_ && root != nullptr) {
+    index_subtree(root.get(), index);
+  }
+
+  delete root_;
+  root_ = root.release();
+  id_index_.swap(index);
+  global_bounds_ = bounds;
+  generation_span_ = generation_span;
+  ++mutation_count_;
+  growth_directions_.swap(growth_directions);
+}
+
+void QuadTree::clusters(const detail::Rect& rect,
+  uint8_t depth,
+  std::vector<Cluster>& out_clusters) const
+{
+  if (root_ != nullptr) {
+    clusters_recursive(root_, global_bounds_, rect, 0u, depth, out_clusters);
+  }
+}
+
+void QuadTree::compute_stats(Stats& out_stats) const
+{
+  out_stats = {};
+  out_stats.leaf_fill_histogram.resize(LEAF_FILL_BUCKETS + 1, 0);
+  out_stats.build_timings = build_timings_;
+
+  compute_stats_recursive(root_, 0u, out_stats);
+
+  std::size_t internal_count = out_stats.node_count - out_stats.leaf_count;
+  if (internal_count != 0) {
+    out_stats.empty_child_ratio =
+      static_cast<double>(out_stats.empty_child_count) /
+      static_cast<double>(4 * internal_count);
+  }
+  out_stats.total_bytes = sizeof(QuadTree) + out_stats.node_bytes +
+    out_stats.leaf_bytes;
+}
+
+void QuadTree::query(const detail::Rect& rect,
+  std::vector<detail::Point>& out_points) const
+{
+  NullQueryTracer tracer;
+  query(rect, out_points, tracer);
+}
+
+QuadTree::Cursor::Cursor(const QuadTree& tree) :
+  tree_(tree),
+  mutation_count_(tree.mutation_count_),
+  path_()
+{
+  path_.reserve(detail::keys::max_depth() + 1);
+}
+
+void QuadTree::Cursor::query(const detail::Rect& rect,
+  std::vector<detail::Point>& out_points)
+{
+  NullQueryTracer tracer;
+  query(rect, out_points, tracer);
+}
+
+uint64_t QuadTree::Cursor::finger_key() const
+{
+  return path_.empty() ? 0 : path_.back().quad_key;
+}
+
+void QuadTree::Cursor::reset()
+{
+  path_.clear();
+  mutation_count_ = tree_.mutation_count_;
+}
+
+const QuadTree::Cursor::Step* QuadTree::Cursor::seek(
+  const detail::Rect& rect)
+{
+  if (mutation_count_ != tree_.mutation_count_) {
+    reset();
+  }
+  const detail::Rect& bounds = tree_.global_bounds_;
+  if (tree_.root_ == nullptr || !detail::intersects(bounds, rect)) {
+    return nullptr;
+  }
+  if (path_.empty()) {
+    path_.push_back({ tree_.root_, bounds, detail::keys::min_id(0) });
+  }
+
+  // Deepest cell holding both corners of rect, by key: the common prefix
+  // of the corner keys at full depth.
+  const uint8_t full_depth = detail::keys::max_depth();
+  const detail::Point low = {
+    0, 0, (std::max)(rect.lx, bounds.lx), (std::max)(rect.ly, bounds.ly)
+  };
+  const detail::Point high = {
+    0, 0, (std::min)(rect.hx, bounds.hx), (std::min)(rect.hy, bounds.hy)
+  };
+  uint64_t query_key = detail::compute_quad_key(low, full_depth, bounds);
+  uint64_t high_key = detail::compute_quad_key(high, full_depth, bounds);
+  uint8_t query_depth = full_depth;
+  while (query_key != high_key) {
+    query_key = detail::keys::compute_parent(query_key);
+    high_key = detail::keys::compute_parent(high_key);
+    --query_depth;
+  }
+
+  // Climb to the common ancestor of the finger and the query's cell.
+  uint64_t finger = path_.back().quad_key;
+  uint8_t finger_depth = static_cast<uint8_t>(path_.size() - 1);
+  while (query_depth > finger_depth) {
+    query_key = detail::keys::compute_parent(query_key);
+    --query_depth;
+  }
+  while (finger_depth > query_depth) {
+    finger = detail::keys::compute_parent(finger);
+    --finger_depth;
+  }
+  while (finger != query_key) {
+    finger = detail::keys::compute_parent(finger);
+    query_key = detail::keys::compute_parent(query_key);
+    --finger_depth;
+  }
+  path_.resize(finger_depth + 1);
+
+  // Keys round differently from cells near cell edges, so keep climbing
+  // until the cell, less its slack, really holds rect, then descend while
+  // a child's does.
+  auto holds = [&rect](const detail::Rect& cell)
+    {
+      float slack = detail::rect_slack(cell, cell);
+      return rect.lx >= cell.lx + slack && rect.hx <= cell.hx - slack &&
+        rect.ly >= cell.ly + slack && rect.hy <= cell.hy - slack;
+    };
+  while (path_.size() > 1 && !holds(path_.back().cell)) {
+    path_.pop_back();
+  }
+  while (!path_.back().node->is_leaf()) {
+    const Step& step = path_.back();
+    std::size_t i = child_slot(step.node, step.cell, {
+      0, 0, rect.lx + (rect.hx - rect.lx) * 0.5f,
+      rect.ly + (rect.hy - rect.ly) * 0.5f });
+    detail::Rect cell = child_cell(step.node, step.cell, i);
+    const Node* child = step.node->children_[i];
+    if (child == nullptr || !holds(cell)) {
+      break;
+    }
+    path_.push_back({ child, cell,
+      detail::keys::child_of(step.quad_key, i) });
+  }
+  return &path_.back();
+}
+
+void QuadTree::query_radius(float x,
+  float y,
+  float radius,
+  std::vector<detail::Point>& out_points) const
+{
+  if (root_ != nullptr && radius >= 0.0f) {
+    query_radius_recursive(root_, global_bounds_, x, y, radius, out_points);
+  }
+}
+
+void QuadTree::query_segment(float x0,
+  float y0,
+  float x1,
+  float y1,
+  float radius,
+  std::vector<detail::Point>& out_points) const
+{
+  if (root_ == nullptr || radius < 0.0f) {
+    return;
+  }
+  const Segment segment = { x0, y0, x1 - x0, y1 - y0, radius };
+  float limit = 1.0f;
+  auto visit = [&out_points](const detail::Point& p, float)
+    {
+      out_points.push_back(p);
+    };
+  segment_recursive(root_, global_bounds_, segment, limit, visit);
+}
+
+bool QuadTree::first_hit(float x0,
+  float y0,
+  float x1,
+  float y1,
+  float radius,
+  detail::Point& out_point) const
+{
+  if (root_ == nullptr || radius < 0.0f) {
+    return false;
+  }
+  const Segment segment = { x0, y0, x1 - x0, y1 - y0, radius };
+  float limit = 1.0f;
+  bool hit = false;
+  auto visit = [&](const detail::Point& p, float t)
+    {
+      if (!hit || t < limit) {
+        hit = true;
+        limit = t;
+        out_point = p;
+      }
+    };
+  segment_recursive(root_, global_bounds_, segment, limit, visit);
+  return hit;
+}
+
+void QuadTree::nearest(float x,
+  float y,
+  std::size_t k,
+  std::vector<detail::Point>& out_points) const
+{
+  out_points.clear();
+  if (root_ == nullptr || k == 0) {
+    return;
+  }
+
+  struct Candidate
+  {
+    float distance_sq;
+    const Node* node;
+    detail::Rect cell;
+
+    bool operator<(const Candidate& other) const
+    {
+      return distance_sq > other.distance_sq;
+    }
+  };
+  typedef std::pair<float, detail::Point> Neighbour_t;
+  auto farther = [](const Neighbour_t& lhs, const Neighbour_t& rhs)
+  {
+    return lhs.first < rhs.first;
+  };
+
+  // cells is a min-heap on the distance to each cell, best a max-heap of
+  // the k nearest points found so far.
+  std::priority_queue<Candidate> cells;
+  std::vector<Neighbour_t> best;
+  best.reserve(k + 1);
+  cells.push({ 0.0f, root_, global_bounds_ });
+  while (!cells.empty()) {
+    Candidate top = cells.top();
+    cells.pop();
+    if (best.size() == k && top.distance_sq > best.front().first) {
+      break;
+    }
+
+    if (top.node->is_leaf()) {
+      for (const detail::Point& p : top.node->points_) {
+        float dx = p.x - x;
+        float dy = p.y - y;
+        float distance_sq = dx * dx + dy * dy;
+        if (best.size() < k) {
+          best.emplace_back(distance_sq, p);
+          std::push_heap(best.begin(), best.end(), farther);
+        } else if (distance_sq < best.front().first) {
+          std::pop_heap(best.begin(), best.end(), farther);
+          best.back() = Neighbour_t(distance_sq, p);
+          std::push_heap(best.begin(), best.end(), farther);
+        }
+      }
+      continue;
+    }
+
+    for (std::size_t i = 0; i < 4; ++i) {
+      const Node* child = top.node->children_[i];
+      if (child == nullptr) {
+        continue;
+      }
+      detail::Rect cell = child_cell(top.node, top.cell, i);
+      float slack = detail::rect_slack(cell, cell);
+      detail::Rect outer = {
+        cell.lx - slack, cell.ly - slack, cell.hx + slack, cell.hy + slack
+      };
+      cells.push({ detail::min_distance_sq(outer, x, y), child, cell });
+    }
+  }
+
+  std::sort_heap(best.begin(), best.end(), farther);
+  out_points.reserve(best.size());
+  for (const Neighbour_t& neighbour : best) {
+    out_points.push_back(neighbour.second);
+  }
+}
+
+uint64_t QuadTree::leaf_key(float x, float y) const
+{
+  const detail::Point point = { 0, 0, x, y };
+  if (root_ == nullptr || !detail::contains(global_bounds_, point)) {
+    return 0;
+  }
+
+  const Node* node = root_;
+  detail::Rect cell = global_bounds_;
+  uint64_t key = detail::keys::min_id(0);
+  while (!node->is_leaf()) {
+    std::size_t i = child_slot(node, cell, point);
+    if (node->children_[i] == nullptr) {
+      return 0;
+    }
+    cell = child_cell(node, cell, i);
+    node = node->children_[i];
+    key = detail::keys::child_of(key, i);
+  }
+  return key;
+}
+
+void QuadTree::neighbour_leaves(uint64_t leaf_key,
+  detail::keys::Direction direction,
+  std::vector<uint64_t>& out_keys) const
+{
+  if (!detail::keys::is_valid(leaf_key)) {
+    return;
+  }
+  uint64_t neighbour = detail::keys::neighbour(leaf_key, direction);
+  if (neighbour == 0) {
+    return;
+  }
+
+  uint64_t key = 0;
+  const Node* node = find_node(neighbour, key);
+  if (node == nullptr) {
+    return;
+  }
+  facing_leaves(node, key, detail::keys::direction_dx(direction),
+    detail::keys::direction_dy(direction), out_keys);
+}
+
+void QuadTree::leaf_points(uint64_t leaf_key,
+  std::vector<detail::Point>& out_points) const
+{
+  if (!detail::keys::is_valid(leaf_key)) {
+    return;
+  }
+  uint64_t key = 0;
+  const Node* node = find_node(leaf_key, key);
+  if (node != nullptr && key == leaf_key && node->is_leaf()) {
+    out_points.insert(out_points.end(), node->points_.begin(),
+      node->points_.end());
+  }
+}
+
+void QuadTree::neighbour_counts(float radius,
+  std::vector<detail::Point>& out_points,
+  std::vector<uint32_t>& out_counts,
+  std::size_t thread_count) const
+{
+  if (thread_count == 0) {
+    thread_count = (std::max)(1u, std::thread::hardware_concurrency());
+  }
+  Neighbourhoods neighbourhoods;
+  build_neighbourhoods(radius, thread_count, out_points, neighbourhoods);
+  count_neighbours(neighbourhoods, radius, thread_count, out_counts);
+}
+
+void QuadTree::dbscan(float radius,
+  std::size_t min_points,
+  std::vector<detail::Point>& out_points,
+  std::vector<int32_t>& out_labels,
+  std::size_t thread_count) const
+{
+  if (thread_count == 0) {
+    thread_count = (std::max)(1u, std::thread::hardware_concurrency());
+  }
+  Neighbourhoods neighbourhoods;
+  build_neighbourhoods(radius, thread_count, out_points, neighbourhoods);
+  std::vector<uint32_t> counts;
+  count_neighbours(neighbourhoods, radius, thread_count, counts);
+  out_labels.assign(out_points.size(), NOISE);
+  if (out_points.empty()) {
+    return;
+  }
+
+  const std::size_t count = out_points.size();
+  const std::size_t none = count;
+  std::vector<std::atomic<std::size_t>> parents(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    parents[i].store(i, std::memory_order_relaxed);
+  }
+  std::vector<std::size_t> border_core(count, none);
+
+  const float radius_sq = radius * radius;
+  const float* xs = neighbourhoods.xs.data();
+  const float* ys = neighbourhoods.ys.data();
+  detail::parallel_for(neighbourhoods.leaves.size(), thread_count,
+    [&](std::size_t leaf, std::size_t)
+    {
+      const Span_t& span = neighbourhoods.leaves[leaf];
+      for (std::size_t i = span.first; i < span.second; ++i) {
+        const bool core = counts[i] >= min_points;
+        for (const Span_t& candidate : neighbourhoods.candidates[leaf]) {
+          bool searching = true;
+          detail::visit_within(xs, ys, candidate.first, candidate.second,
+            xs[i], ys[i], radius_sq,
+            [&](std::size_t j)
+            {
+              if (counts[j] < min_points) {
+                return true;
+              }
+              if (core) {
+                if (j < i) {
+                  detail::unite_roots(parents, i, j);
+                }
+                return true;
+              }
+              border_core[i] = j;
+              searching = false;
+              return false;
+            });
+          if (!searching) {
+            break;
+          }
+        }
+      }
+    });
+
+  std::vector<int32_t> cluster_of_root(count, NOISE);
+  int32_t next_cluster = 0;
+  for (std::size_t i = 0; i < count; ++i) {
+    if (counts[i] < min_points) {
+      continue;
+    }
+    std::size_t root = detail::find_root(parents, i);
+    if (cluster_of_root[root] == NOISE) {
+      cluster_of_root[root] = next_cluster++;
+    }
+    out_labels[i] = cluster_of_root[root];
+  }
+  for (std::size_t i = 0; i < count; ++i) {
+    if (border_core[i] != none) {
+      out_labels[i] = out_labels[border_core[i]];
+    }
+  }
+}
+
+void QuadTree::build_neighbourhoods(float radius,
+  std::size_t thread_count,
+  std::vector<detail::Point>& out_points,
+  Neighbourhoods& out_neighbourhoods) const
+{
+  out_points.clear();
+  out_neighbourhoods = {};
+  if (root_ == nullptr || radius < 0.0f) {
+    return;
+  }
+
+  std::vector<const Node*> leaves;
+  std::vector<detail::Rect> cells;
+  collect_leaves(root_, out_points, leaves, cells, global_bounds_);
+
+  // Coordinates are copied out of the points so the kernel reads
+  // contiguous floats.
+  out_neighbourhoods.xs.resize(out_points.size());
+  out_neighbourhoods.ys.resize(out_points.size());
+  for (std::size_t i = 0; i < out_points.size(); ++i) {
+    out_neighbourhoods.xs[i] = out_points[i].x;
+    out_neighbourhoods.ys[i] = out_points[i].y;
+  }
+
+  std::unordered_map<const Node*, std::size_t> leaf_index;
+  out_neighbourhoods.leaves.reserve(leaves.size());
+  std::size_t begin = 0;
+  for (std::size_t i = 0; i < leaves.size(); ++i) {
+    leaf_index[leaves[i]] = i;
+    std::size_t end = begin + leaves[i]->points_.size();
+    out_neighbourhoods.leaves.push_back({ begin, end });
+    begin = end;
+  }
+
+  out_neighbourhoods.candidates.resize(leaves.size());
+  detail::parallel_for(leaves.size(), thread_count,
+    [&](std::size_t leaf, std::size_t)
+    {
+      std::vector<const Node*> near;
+      leaves_within(root_, global_bounds_, cells[leaf], radius, near);
+      std::vector<Span_t>& candidates =
+        out_neighbourhoods.candidates[leaf];
+      candidates.reserve(near.size());
+      for (const Node* node : near) {
+        candidates.push_back(
+          out_neighbourhoods.leaves[leaf_index.at(node)]);
+      }
+    });
+}
+
+void QuadTree::count_neighbours(const Neighbourhoods& neighbourhoods,
+  float radius,
+  std::size_t thread_count,
+  std::vector<uint32_t>& out_counts)
+{
+  out_counts.assign(neighbourhoods.xs.size(), 0);
+  const float radius_sq = radius * radius;
+  const float* xs = neighbourhoods.xs.data();
+  const float* ys = neighbourhoods.ys.data();
+  detail::parallel_for(neighbourhoods.leaves.size(), thread_count,
+    [&](std::size_t leaf, std::size_t)
+    {
+      const Span_t& span = neighbourhoods.leaves[leaf];
+      for (std::size_t i = span.first; i < span.second; ++i) {
+        uint32_t count = 0;
+        for (const Span_t& candidate : neighbourhoods.candidates[leaf]) {
+          detail::visit_within(xs, ys, candidate.first, candidate.second,
+            xs[i], ys[i], radius_sq,
+            [&count](std::size_t)
+            {
+              ++count;
+              return true;
+            });
+        }
+        out_counts[i] = count;
+      }
+    });
+}
+
+void QuadTree::collect_leaves(const Node* node,
+  std::vector<detail::Point>& out_points,
+  std::vector<const Node*>& out_leaves,
+  std::vector<detail::Rect>& out_cells,
+  const detail::Rect& cell)
+{
+  if (node->is_leaf()) {
+    if (!node->points_.empty()) {
+      out_points.insert(out_points.end(), node->points_.begin(),
+        node->points_.end());
+      out_leaves.push_back(node);
+      out_cells.push_back(cell);
+    }
+    return;
+  }
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (node->children_[i] != nullptr) {
+      collect_leaves(node->children_[i], out_points, out_leaves, out_cells,
+        child_cell(node, cell, i));
+    }
+  }
+}
+
+void QuadTree::leaves_within(const Node* node,
+  const detail::Rect& cell,
+  const detail::Rect& target,
+  float radius,
+  std::vector<const Node*>& out_leaves)
+{
+  if (!detail::rects_within(cell, target, radius)) {
+    return;
+  }
+  if (node->is_leaf()) {
+    if (!node->points_.empty()) {
+      out_leaves.push_back(node);
+    }
+    return;
+  }
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (node->children_[i] != nullptr) {
+      leaves_within(node->children_[i], child_cell(node, cell, i),
+        target, radius, out_leaves);
+    }
+  }
+}
+
+void QuadTree::spatial_join(const QuadTree& other,
+  float distance,
+  std::vector<PointPair_t>& out_pairs,
+  std::size_t thread_count) const
+{
+  if (root_ == nullptr || other.root_ == nullptr || distance < 0.0f) {
+    return;
+  }
+
+  if (thread_count == 0) {
+    thread_count = (std::max)(1u, std::thread::hardware_concurrency());
+  }
+
+  // Split node pairs breadth first on this thread until there are enough
+  // independent pairs to keep every worker busy.
+  std::vector<NodePair> tasks = {
+    { root_, global_bounds_, other.root_, other.global_bounds_ }
+  };
+  const std::size_t target_task_count = thread_count * 16;
+  bool split_any = true;
+  while (split_any && tasks.size() < target_task_count) {
+    split_any = false;
+    std::vector<NodePair> next_tasks;
+    for (const NodePair& task : tasks) {
+      if (!detail::rects_within(task.lhs_rect, task.rhs_rect, distance)) {
+        continue;
+      }
+      if (split_node_pair(task, next_tasks)) {
+        split_any = true;
+      } else {
+        next_tasks.push_back(task);
+      }
+    }
+    tasks.swap(next_tasks);
+  }
+
+  std::vector<std::vector<PointPair_t>> buffers(thread_count);
+  detail::parallel_for(tasks.size(), thread_count,
+    [&](std::size_t task, std::size_t thread)
+    {
+      spatial_join_node_pair(tasks[task], distance, buffers[thread]);
+    });
+
+  std::size_t total = out_pairs.size();
+  for (const std::vector<PointPair_t>& buffer : buffers) {
+    total += buffer.size();
+  }
+  out_pairs.reserve(total);
+  for (const std::vector<PointPair_t>& buffer : buffers) {
+    out_pairs.insert(out_pairs.end(), buffer.begin(), buffer.end());
+  }
+}
+
+void QuadTree::build_tree(Node* node, 
+  std::vector<detail::Point*>::iterator begin,
+  std::vector<detail::Point*>::iterator end,
+  uint8_t depth)
+{
+  auto count = std::distance(begin, end);
+
+  if (node == nullptr || count == 0) {
+    return;
+  }
+
+  if (count <= MAX_BLOCK_SIZE || depth == detail::keys::max_depth()) {
+    auto start = detail::Clock_t::now();
+    node->set_data(begin, end);
+    build_timings_.allocation += detail::elapsed_since(start);
+  } else {
+    auto start = detail::Clock_t::now();
+    const detail::Point& ip = **begin;
+    uint64_t p_pid = detail::compute_quad_key(ip, depth, global_bounds_);
+    detail::Children_t children;
+    detail::keys::compute_children(p_pid, children);
+
+    // Key every point first so the buckets can be sized exactly before
+    // any of them are filled.
+    const uint64_t min_id = children[0];
+    std::vector<uint8_t> bucket_indices(count);
+    std::size_t bucket_sizes[4] = { 0, 0, 0, 0 };
+    std::vector<detail::Point*>::iterator it = begin;
+    for (std::size_t i = 0; it != end; ++it, ++i) {
+      uint64_t c_pid = detail::compute_quad_key(**it, depth + 1,
+        global_bounds_);
+
+      uint64_t expected_parent = detail::keys::compute_parent(c_pid);
+      if (expected_parent != node->quad_key_) {
+        throw std::runtime_error("A quadkey got bucketed wrong.");
+      }
+
+      bucket_indices[i] = static_cast<uint8_t>(c_pid - min_id);
+      ++bucket_sizes[bucket_indices[i]];
+    }
+    build_timings_.keying += detail::elapsed_since(start);
+
+    start = detail::Clock_t::now();
+    std::vector<detail::Point*> buckets[4];
+    for (std::size_t i = 0; i < 4; ++i) {
+      buckets[i].reserve(bucket_sizes[i]);
+    }
+    it = begin;
+    for (std::size_t i = 0; it != end; ++it, ++i) {
+      buckets[bucket_indices[i]].push_back(*it);
+    }
+    build_timings_.partitioning += detail::elapsed_since(start);
+
+    for (std::size_t i = 0; i < 4; ++i) {
+      if (!buckets[i].empty()) {
+        start = detail::Clock_t::now();
+        node->children_[i] = new Node(children[i]);
+        build_timings_.allocation += detail::elapsed_since(start);
+        build_tree(
+          node->children_[i],
+          buckets[i].begin(),
+          buckets[i].end(),
+          depth + 1);
+      }
+    }
+  }
+
+  node->summarize();
+}
+
+void QuadTree::build_sorted(Node* node,
+  std::vector<KeyedPoint_t>::const_iterator begin,
+  std::vector<KeyedPoint_t>::const_iterator end,
+  uint8_t depth)
+{
+  const std::size_t count = std::distance(begin, end);
+  if (count <= MAX_BLOCK_SIZE || depth == detail::keys::max_depth()) {
+    std::vector<AgedPoint_t> items;
+    items.reserve(count);
+    for (auto it = begin; it != end; ++it) {
+      items.push_back(it->second);
+    }
+    assign_points(node, items);
+    return;
+  }
+
+  // Every key in the range shares node's prefix, so the child digit
+  // below it only grows along the range.
+  const unsigned shift = 2u * (detail::keys::max_depth() - depth - 1u);
+  detail::Children_t children;
+  detail::keys::compute_children(node->quad_key_, children);
+  for (std::size_t i = 0; i < 4; ++i) {
+    auto last = std::partition_point(begin, end,
+      [shift, i](const KeyedPoint_t& kp)
+      {
+        return ((kp.first >> shift) & 0x3) <= i;
+      });
+    if (last != begin) {
+      node->children_[i] = new Node(children[i]);
+      build_sorted(node->children_[i], begin, last, depth + 1);
+    }
+    begin = last;
+  }
+  node->summarize();
+}
+
+QuadTree::Node* QuadTree::merge_nodes(Node* into,
+  Node* from,
+  const detail::Rect& cell,
+  uint64_t quad_key,
+  uint8_t depth)
+{
+  if (into->is_leaf() && !from->is_leaf()) {
+    std::swap(into, from);
+    adopt(into, quad_key);
+  }
+  if (from->is_leaf()) {
+    std::vector<AgedPoint_t> items;
+    leaf_items(from, items);
+    merge_points(into, std::move(items), cell, quad_key, depth);
+    delete from;
+    return into;
+  }
+
+  detail::Children_t children;
+  detail::keys::compute_children(quad_key, children);
+  for (std::size_t i = 0; i < 4; ++i) {
+    Node* child = from->children_[i];
+    from->children_[i] = nullptr;
+    if (child == nullptr) {
+      continue;
+    }
+    if (into->children_[i] == nullptr) {
+      adopt(child, children[i]);
+      into->children_[i] = child;
+    } else {
+      into->children_[i] = merge_nodes(into->children_[i], child,
+        child_cell(into, cell, i), children[i], depth + 1);
+    }
+  }
+  delete from;
+  into->summarize();
+  return into;
+}
+
+void QuadTree::merge_points(Node* node,
+  std::vector<AgedPoint_t>&& items,
+  const detail::Rect& cell,
+  uint64_t quad_key,
+  uint8_t depth)
+{
+  if (node->is_leaf()) {
+    leaf_items(node, items);
+    assign_points(node, items);
+    if (node->points_.size() > MAX_BLOCK_SIZE &&
+      depth < detail::keys::max_depth()) {
+      split_leaf(node, cell, depth);
+    }
+    return;
+  }
+
+  std::vector<AgedPoint_t> groups[4];
+  for (const AgedPoint_t& item : items) {
+    groups[child_slot(node, cell, item.second)].push_back(item);
+  }
+  detail::Children_t children;
+  detail::keys::compute_children(quad_key, children);
+  const uint8_t epoch = static_cast<uint8_t>(growth_directions_.size());
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (groups[i].empty()) {
+      continue;
+    }
+    if (node->children_[i] == nullptr) {
+      node->children_[i] = new Node(children[i], epoch);
+    }
+    merge_points(node->children_[i], std::move(groups[i]),
+      child_cell(node, cell, i), children[i], depth + 1);
+  }
+  node->summarize();
+}
+
+std::size_t QuadTree::expire_recursive(Node* node, uint64_t first_live)
+{
+  if (node->summary_.oldest_generation >= first_live) {
+    return 0;
+  }
+
+  if (node->is_leaf()) {
+    std::vector<Node::Group>& groups = node->groups_;
+    std::size_t expired = 0;
+    while (expired < groups.size() &&
+      groups[expired].generation < first_live) {
+      ++expired;
+    }
+    if (expired == 0) {
+      return 0;
+    }
+    const std::size_t cut = groups[expired - 1].end;
+    if (id_index_enabled_) {
+      for (std::size_t i = 0; i < cut; ++i) {
+        id_index_.erase(node->points_[i].id);
+      }
+    }
+    node->points_.erase(node->points_.begin(), node->points_.begin() + cut);
+    groups.erase(groups.begin(), groups.begin() + expired);
+    for (Node::Group& group : groups) {
+      group.end -= cut;
+    }
+    if (id_index_enabled_) {
+      index_leaf(node);
+    }
+    node->summarize();
+    return cut;
+  }
+
+  std::size_t removed = 0;
+  bool leaves_only = true;
+  for (Node*& child : node->children_) {
+    if (child == nullptr) {
+      continue;
+    }
+    removed += expire_recursive(child, first_live);
+    if (child->summary_.count == 0) {
+      delete child;
+      child = nullptr;
+    } else if (!child->is_leaf()) {
+      leaves_only = false;
+    }
+  }
+  node->summarize();
+
+  // Children that now fit in one leaf are folded back into node.
+  if (leaves_only && node->summary_.count <= MAX_BLOCK_SIZE) {
+    std::vector<AgedPoint_t> items;
+    for (Node*& child : node->children_) {
+      if (child != nullptr) {
+        leaf_items(child, items);
+        delete child;
+        child = nullptr;
+      }
+    }
+    assign_points(node, items);
+  }
+  return removed;
+}
+
+void QuadTree::assign_points(Node* leaf, std::vector<AgedPoint_t>& items)
+{
+  std::stable_sort(items.begin(), items.end(),
+    [](const AgedPoint_t& x, const AgedPoint_t& y)
+    {
+      return x.first < y.first;
+    });
+  leaf->points_.clear();
+  leaf->groups_.clear();
+  leaf->points_.reserve(items.size());
+  for (const AgedPoint_t& item : items) {
+    leaf->points_.push_back(item.second);
+    if (item.first == NO_EXPIRY) {
+      continue;
+    }
+    if (leaf->groups_.empty() ||
+      leaf->groups_.back().generation != item.first) {
+      leaf->groups_.push_back({ item.first, 0 });
+    }
+    leaf->groups_.back().end = leaf->points_.size();
+  }
+  leaf->summarize();
+  if (id_index_enabled_) {
+    index_leaf(leaf);
+  }
+}
+
+void QuadTree::leaf_items(const Node* leaf,
+  std::vector<AgedPoint_t>& out_items)
+{
+  std::size_t group = 0;
+  for (std::size_t i = 0; i < leaf->points_.size(); ++i) {
+    while (group < leaf->groups_.size() && leaf->groups_[group].end <= i) {
+      ++group;
+    }
+    uint64_t generation = group < leaf->groups_.size() ?
+      leaf->groups_[group].generation : NO_EXPIRY;
+    out_items.emplace_back(generation, leaf->points_[i]);
+  }
+}
+
+void QuadTree::subtree_items(const Node* node,
+  std::vector<AgedPoint_t>& out_items)
+{
+  leaf_items(node, out_items);
+  for (const Node* child : node->children_) {
+    if (child != nullptr) {
+      subtree_items(child, out_items);
+    }
+  }
+}
+
+void QuadTree::index_leaf(Node* leaf, std::size_t first)
+{
+  for (std::size_t i = first; i < leaf->points_.size(); ++i) {
+    id_index_[leaf->points_[i].id] = { leaf, i };
+  }
+}
+
+void QuadTree::index_subtree(Node* node, IdIndex_t& out_index)
+{
+  for (std::size_t i = 0; i < node->points_.size(); ++i) {
+    if (!out_index.emplace(node->points_[i].id, Slot { node, i }).second) {
+      throw std::runtime_error("Two points in the tree share an id.");
+    }
+  }
+  for (Node* child : node->children_) {
+    if (child != nullptr) {
+      index_subtree(child, out_index);
+    }
+  }
+}
+
+void QuadTree::adopt(Node* node, uint64_t quad_key)
+{
+  node->quad_key_ = quad_key;
+  node->key_epoch_ = static_cast<uint8_t>(growth_directions_.size());
+  if (node->is_leaf()) {
+    return;
+  }
+  detail::Children_t children;
+  detail::keys::compute_children(quad_key, children);
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (node->children_[i] != nullptr) {
+      adopt(node->children_[i], children[i]);
+    }
+  }
+}
+
+void QuadTree::grow_toward(const detail::Point& point)
+{
+  if (growth_directions_.size() >= detail::keys::max_depth()) {
+    throw std::runtime_error("The root cannot grow any further.");
+  }
+
+  float width = global_bounds_.hx - global_bounds_.lx;
+  float height = global_bounds_.hy - global_bounds_.ly;
+  if (width <= 0.0f) {
+    width = (std::max)(height, 1.0f);
+  }
+  if (height <= 0.0f) {
+    height = (std::max)(width, 1.0f);
+  }
+
+  // The new root spans twice the extent toward the point, which leaves the
+  // old root in the opposite quadrant of the new one.
+  detail::Rect bounds = global_bounds_;
+  bool grow_left = point.x < bounds.lx;
+  bool grow_down = point.y < bounds.ly;
+  if (grow_left) {
+    bounds.lx = bounds.hx - 2.0f * width;
+  } else {
+    bounds.hx = bounds.lx + 2.0f * width;
+  }
+  if (grow_down) {
+    bounds.ly = bounds.hy - 2.0f * height;
+  } else {
+    bounds.hy = bounds.ly + 2.0f * height;
+  }
+
+  uint8_t quadrant = (grow_left ? 0x1 : 0x0) | (grow_down ? 0x2 : 0x0);
+  grow(quadrant, bounds);
+  if (change_log_ != nullptr) {
+    change_log_->append_grow(quadrant, bounds);
+  }
+}
+
+void QuadTree::grow(uint8_t quadrant, const detail::Rect& bounds)
+{
+  if (growth_directions_.size() >= detail::keys::max_depth()) {
+    throw std::runtime_error("The root cannot grow any further.");
+  }
+  // Every node moves one level down, so the deepest leaf must have room
+  // for one more level in its key.
+  if (root_->summary_.height >= detail::keys::max_depth()) {
+    throw std::runtime_error("The root cannot grow without pushing a leaf "
+      "past the maximum depth.");
+  }
+
+  // The new root splits at the old root's corner facing its middle, which
+  // leaves the old root's cell exactly as it was.
+  const detail::Rect old_bounds = global_bounds_;
+  global_bounds_ = bounds;
+  growth_directions_.push_back(quadrant);
+
+  // Only the new root gets a key now. Every existing node keeps its old
+  // key and epoch and is re-prefixed when its key is next needed.
+  Node* new_root = new Node(detail::keys::min_id(0),
+    static_cast<uint8_t>(growth_directions_.size()));
+  new_root->has_split_ = true;
+  new_root->kept_child_ = quadrant;
+  new_root->split_x_ = (quadrant & 0x1) ? old_bounds.lx : old_bounds.hx;
+  new_root->split_y_ = (quadrant & 0x2) ? old_bounds.ly : old_bounds.hy;
+  new_root->children_[quadrant] = root_;
+  new_root->summary_ = root_->summary_;
+  ++new_root->summary_.height;
+  root_ = new_root;
+}
+
+detail::Rect QuadTree::key_cell(uint64_t quad_key) const
+{
+  const uint8_t depth = detail::keys::key_depth(quad_key);
+  const Node* node = root_;
+  detail::Rect cell = global_bounds_;
+  for (uint8_t level = 1; level <= depth; ++level) {
+    std::size_t i = (quad_key >> (2u * (depth - level))) & 0x3;
+    if (node != nullptr) {
+      cell = child_cell(node, cell, i);
+      node = node->children_[i];
+    } else {
+      cell = detail::child_rect(cell, i);
+    }
+  }
+  return cell;
+}
+
+bool QuadTree::same_splits(const Node* a, const Node* b)
+{
+  if (a == nullptr || b == nullptr) {
+    return true;
+  }
+  if (a->has_split_ != b->has_split_) {
+    return false;
+  }
+  // Only grown roots split, and below a node that does not split no node
+  // does.
+  if (!a->has_split_) {
+    return true;
+  }
+  if (a->kept_child_ != b->kept_child_ || a->split_x_ != b->split_x_ ||
+    a->split_y_ != b->split_y_) {
+    return false;
+  }
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (!same_splits(a->children_[i], b->children_[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint64_t QuadTree::placement_key(const detail::Point& point) const
+{
+  const Node* node = root_;
+  detail::Rect cell = global_bounds_;
+  uint64_t key = detail::keys::min_id(0);
+  while (!node->is_leaf()) {
+    std::size_t i = child_slot(node, cell, point);
+    key = detail::keys::child_of(key, i);
+    if (node->children_[i] == nullptr) {
+      break;
+    }
+    cell = child_cell(node, cell, i);
+    node = node->children_[i];
+  }
+  return key;
+}
+
+QuadTree::Node* QuadTree::insert_at(uint64_t quad_key,
+  const detail::Point& point,
+  uint64_t generation,
+  detail::Rect& out_cell)
+{
+  const uint8_t depth = detail::keys::key_depth(quad_key);
+  const uint8_t epoch = static_cast<uint8_t>(growth_directions_.size());
+  Node* node = root_;
+  out_cell = global_bounds_;
+  node->add_to_summary(point);
+  node->summary_.oldest_generation =
+    (std::min)(node->summary_.oldest_generation, generation);
+  for (uint8_t level = 1; level <= depth; ++level) {
+    std::size_t i = (quad_key >> (2u * (depth - level))) & 0x3;
+    node->summary_.height = (std::max)(node->summary_.height,
+      static_cast<uint8_t>(depth - level + 1));
+    if (node->children_[i] == nullptr) {
+      if (node->is_leaf() && !node->points_.empty()) {
+        throw std::runtime_error("The change log does not match the tree.");
+      }
+      detail::Children_t children;
+      detail::keys::compute_children(refresh_key(node), children);
+      node->children_[i] = new Node(children[i], epoch);
+    }
+    out_cell = child_cell(node, out_cell, i);
+    node = node->children_[i];
+    node->add_to_summary(point);
+    node->summary_.oldest_generation =
+      (std::min)(node->summary_.oldest_generation, generation);
+  }
+  if (!node->is_leaf()) {
+    throw std::runtime_error("The change log does not match the tree.");
+  }
+
+  if (generation == NO_EXPIRY) {
+    node->points_.push_back(point);
+    if (id_index_enabled_) {
+      id_index_[point.id] = { node, node->points_.size() - 1 };
+    }
+    return node;
+  }
+
+  // The point goes at the end of its generation's group, which is opened
+  // if the leaf has none, and every later point shifts up one slot.
+  std::vector<Node::Group>& groups = node->groups_;
+  auto group = std::lower_bound(groups.begin(), groups.end(), generation,
+    [](const Node::Group& g, uint64_t value)
+    {
+      return g.generation < value;
+    });
+  if (group == groups.end() || group->generation != generation) {
+    std::size_t begin = group == groups.begin() ? 0 : (group - 1)->end;
+    group = groups.insert(group, { generation, begin });
+  }
+  const std::size_t slot = group->end;
+  for (; group != groups.end(); ++group) {
+    ++group->end;
+  }
+  node->points_.insert(node->points_.begin() + slot, point);
+  if (id_index_enabled_) {
+    index_leaf(node, slot);
+  }
+  return node;
+}
+
+uint64_t QuadTree::locate(const detail::Point& point) const
+{
+  if (root_ == nullptr) {
+    return 0;
+  }
+  if (id_index_enabled_) {
+    auto it = id_index_.find(point.id);
+    if (it == id_index_.end() || !detail::same_point(
+      it->second.leaf->points_[it->second.index], point)) {
+      return 0;
+    }
+    return current_key(it->second.leaf);
+  }
+  return locate_recursive(root_, global_bounds_, detail::keys::min_id(0),
+    point);
+}
+
+uint64_t QuadTree::locate_recursive(const Node* node,
+  const detail::Rect& cell,
+  uint64_t quad_key,
+  const detail::Point& point)
+{
+  float slack = detail::rect_slack(cell, cell);
+  detail::Rect outer = {
+    cell.lx - slack, cell.ly - slack, cell.hx + slack, cell.hy + slack
+  };
+  if (!detail::contains(outer, point)) {
+    return 0;
+  }
+
+  if (node->is_leaf()) {
+    for (const detail::Point& p : node->points_) {
+      if (detail::same_point(p, point)) {
+        return quad_key;
+      }
+    }
+    return 0;
+  }
+
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (node->children_[i] == nullptr) {
+      continue;
+    }
+    uint64_t found = locate_recursive(node->children_[i],
+      child_cell(node, cell, i), detail::keys::child_of(quad_key, i),
+      point);
+    if (found != 0) {
+      return found;
+    }
+  }
+  return 0;
+}
+
+bool QuadTree::erase_at(uint64_t quad_key,
+  const detail::Point& point,
+  uint64_t& out_generation)
+{
+  if (root_ == nullptr) {
+    return false;
+  }
+
+  const uint8_t depth = detail::keys::key_depth(quad_key);
+  Node* path[detail::keys::max_depth() + 1] = {};
+  std::size_t slots[detail::keys::max_depth() + 1] = {};
+  path[0] = root_;
+  for (uint8_t level = 1; level <= depth; ++level) {
+    slots[level] = (quad_key >> (2u * (depth - level))) & 0x3;
+    path[level] = path[level - 1]->children_[slots[level]];
+    if (path[level] == nullptr) {
+      return false;
+    }
+  }
+
+  Node* leaf = path[depth];
+  std::vector<detail::Point>& points = leaf->points_;
+  auto it = points.end();
+  auto slot = id_index_enabled_ ? id_index_.find(point.id) :
+    id_index_.end();
+  if (slot != id_index_.end()) {
+    if (slot->second.leaf == leaf &&
+      detail::same_point(points[slot->second.index], point)) {
+      it = points.begin() + slot->second.index;
+    }
+  } else {
+    it = std::find_if(points.begin(), points.end(),
+      [&point](const detail::Point& p)
+      {
+        return detail::same_point(p, point);
+      });
+  }
+  if (!leaf->is_leaf() || it == points.end()) {
+    return false;
+  }
+
+  // The last point of the erased one's group takes its slot, the last
+  // point of the next group takes that one's, and so on, so one point per
+  // group moves and the groups stay contiguous.
+  std::vector<Node::Group>& groups = leaf->groups_;
+  std::size_t hole = it - points.begin();
+  auto group = std::upper_bound(groups.begin(), groups.end(), hole,
+    [](std::size_t value, const Node::Group& g)
+    {
+      return value < g.end;
+    });
+  out_generation = group == groups.end() ? NO_EXPIRY : group->generation;
+  auto fill = [&](std::size_t last)
+    {
+      if (last != hole) {
+        points[hole] = points[last];
+        if (id_index_enabled_) {
+          id_index_[points[hole].id].index = hole;
+        }
+      }
+      hole = last;
+    };
+  for (auto g = group; g != groups.end(); ++g) {
+    fill(--g->end);
+  }
+  fill(points.size() - 1);
+  points.pop_back();
+  if (group != groups.end() &&
+    group->end == (group == groups.begin() ? 0 : (group - 1)->end)) {
+    groups.erase(group);
+  }
+  if (id_index_enabled_) {
+    id_index_.erase(point.id);
+  }
+
+  for (uint8_t level = depth; level > 0; --level) {
+    Node* node = path[level];
+    if (node->is_leaf() && node->points_.empty()) {
+      path[level - 1]->children_[slots[level]] = nullptr;
+      delete node;
+    } else {
+      node->summarize();
+    }
+  }
+  root_->summarize();
+  return true;
+}
+
+void QuadTree::split_if_full(Node* leaf,
+  const detail::Rect& cell,
+  uint64_t quad_key)
+{
+  const uint8_t depth = detail::keys::key_depth(quad_key);
+  if (leaf->points_.size() > MAX_BLOCK_SIZE &&
+    depth < detail::keys::max_depth()) {
+    if (change_log_ != nullptr) {
+      change_log_->append_split(quad_key);
+    }
+    split_leaf(leaf, cell, depth);
+    raise_heights(quad_key);
+  }
+}
+
+void QuadTree::raise_heights(uint64_t quad_key)
+{
+  const uint8_t depth = detail::keys::key_depth(quad_key);
+  Node* node = root_;
+  for (uint8_t level = 0; level < depth && node != nullptr; ++level) {
+    std::size_t i = (quad_key >> (2u * (depth - level - 1))) & 0x3;
+    node = node->children_[i];
+  }
+  if (node == nullptr) {
+    return;
+  }
+  const uint8_t reach = depth + node->summary_.height;
+  node = root_;
+  for (uint8_t level = 0; level < depth; ++level) {
+    node->summary_.height = (std::max)(node->summary_.height,
+      static_cast<uint8_t>(reach - level));
+    node = node->children_[(quad_key >> (2u * (depth - level - 1))) & 0x3];
+  }
+}
+
+void QuadTree::write_node(std::ostream& out, const Node* node)
+{
+  uint8_t child_mask = node->has_split_ ? detail::checkpoint_split_flag_ : 0;
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (node->children_[i] != nullptr) {
+      child_mask |= static_cast<uint8_t>(1u << i);
+    }
+  }
+  detail::write_value(out, child_mask);
+  if (node->has_split_) {
+    detail::write_value(out, node->kept_child_);
+    detail::write_value(out, node->split_x_);
+    detail::write_value(out, node->split_y_);
+  }
+  detail::write_value(out, static_cast<uint32_t>(node->points_.size()));
+  for (const detail::Point& point : node->points_) {
+    detail::write_point(out, point);
+  }
+  detail::write_value(out, static_cast<uint32_t>(node->groups_.size()));
+  for (const Node::Group& group : node->groups_) {
+    detail::write_value(out, group.generation);
+    detail::write_value(out, static_cast<uint32_t>(group.end));
+  }
+  for (const Node* child : node->children_) {
+    if (child != nullptr) {
+      write_node(out, child);
+    }
+  }
+}
+
+QuadTree::Node* QuadTree::read_node(std::istream& in,
+  uint64_t quad_key,
+  uint8_t depth,
+  uint8_t key_epoch)
+{
+  uint8_t child_mask = 0;
+  detail::read_value(in, child_mask);
+  if (child_mask > (detail::checkpoint_split_flag_ | 0xf)) {
+    throw std::runtime_error("The checkpoint is corrupt.");
+  }
+  std::unique_ptr<Node> node = std::make_unique<Node>(quad_key, key_epoch);
+  if (child_mask & detail::checkpoint_split_flag_) {
+    node->has_split_ = true;
+    detail::read_value(in, node->kept_child_);
+    detail::read_value(in, node->split_x_);
+    detail::read_value(in, node->split_y_);
+    child_mask &= 0xf;
+    if (node->kept_child_ > 3) {
+      throw std::runtime_error("The checkpoint is corrupt.");
+    }
+  }
+
+  uint32_t point_count = 0;
+  detail::read_value(in, point_count);
+  if ((child_mask != 0 && point_count != 0) ||
+    (child_mask != 0 && depth >= detail::keys::max_depth())) {
+    throw std::runtime_error("The checkpoint is corrupt.");
+  }
+
+  node->points_.resize(point_count);
+  for (detail::Point& point : node->points_) {
+    detail::read_point(in, point);
+  }
+  uint32_t group_count = 0;
+  detail::read_value(in, group_count);
+  if (group_count > point_count) {
+    throw std::runtime_error("The checkpoint is corrupt.");
+  }
+  node->groups_.resize(group_count);
+  for (std::size_t i = 0; i < group_count; ++i) {
+    uint32_t end = 0;
+    detail::read_value(in, node->groups_[i].generation);
+    detail::read_value(in, end);
+    node->groups_[i].end = end;
+    const Node::Group* previous = i > 0 ? &node->groups_[i - 1] : nullptr;
+    if (end > point_count || node->groups_[i].generation == NO_EXPIRY ||
+      (previous != nullptr && (end <= previous->end ||
+        node->groups_[i].generation <= previous->generation)) ||
+      (previous == nullptr && end == 0)) {
+      throw std::runtime_error("The checkpoint is corrupt.");
+    }
+  }
+  if (!in) {
+    throw std::runtime_error("The checkpoint is truncated.");
+  }
+
+  if (child_mask != 0) {
+    detail::Children_t children;
+    detail::keys::compute_children(quad_key, children);
+    for (std::size_t i = 0; i < 4; ++i) {
+      if (child_mask & (1u << i)) {
+        node->children_[i] = read_node(in, children[i], depth + 1,
+          key_epoch);
+      }
+    }
+  }
+  node->summarize();
+  return node.release();
+}
+
+const QuadTree::Node* QuadTree::find_node(uint64_t quad_key,
+  uint64_t& out_key) const
+{
+  const uint8_t depth = detail::keys::key_depth(quad_key);
+  const Node* node = root_;
+  out_key = detail::keys::min_id(0);
+  for (uint8_t level = 1; node != nullptr && level <= depth; ++level) {
+    if (node->is_leaf()) {
+      break;
+    }
+    std::size_t i = (quad_key >> (2u * (depth - level))) & 0x3;
+    node = node->children_[i];
+    out_key = (out_key << 2) + i;
+  }
+  return node;
+}
+
+void QuadTree::facing_leaves(const Node* node,
+  uint64_t quad_key,
+  int dx,
+  int dy,
+  std::vector<uint64_t>& out_keys)
+{
+  if (node->is_leaf()) {
+    out_keys.push_back(quad_key);
+    return;
+  }
+  for (std::size_t i : { 0, 1, 2, 3 }) {
+    bool east = (i & 0x1) != 0;
+    bool north = (i & 0x2) != 0;
+    if ((dx > 0 && east) || (dx < 0 && !east) ||
+      (dy > 0 && north) || (dy < 0 && !north) ||
+      node->children_[i] == nullptr) {
+      continue;
+    }
+    facing_leaves(node->children_[i], detail::keys::child_of(quad_key, i),
+      dx, dy, out_keys);
+  }
+}
+
+uint64_t QuadTree::current_key(const Node* node) const
+{
+  uint64_t quad_key = node->quad_key_;
+  for (std::size_t epoch = node->key_epoch_;
+    epoch < growth_directions_.size();
+    ++epoch) {
+    quad_key = detail::prefix_key(quad_key, growth_directions_[epoch]);
+  }
+  return quad_key;
+}
+
+uint64_t QuadTree::refresh_key(Node* node)
+{
+  node->quad_key_ = current_key(node);
+  node->key_epoch_ = static_cast<uint8_t>(growth_directions_.size());
+  return node->quad_key_;
+}
+
+void QuadTree::split_leaf(Node* node, const detail::Rect& cell, uint8_t depth)
+{
+  detail::Children_t children;
+  detail::keys::compute_children(refresh_key(node), children);
+  const uint8_t epoch = static_cast<uint8_t>(growth_directions_.size());
+
+  std::vector<AgedPoint_t> items;
+  leaf_items(node, items);
+  node->points_.clear();
+  node->points_.shrink_to_fit();
+  node->groups_.clear();
+  std::vector<AgedPoint_t> buckets[4];
+  for (const AgedPoint_t& item : items) {
+    buckets[child_slot(node, cell, item.second)].push_back(item);
+  }
+
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (buckets[i].empty()) {
+      continue;
+    }
+    Node* child = new Node(children[i], epoch);
+    node->children_[i] = child;
+    assign_points(child, buckets[i]);
+    if (child->points_.size() > MAX_BLOCK_SIZE &&
+      depth + 1 < detail::keys::max_depth()) {
+      split_leaf(child, child_cell(node, cell, i), depth + 1);
+    }
+  }
+  node->summarize();
+}
+
+void QuadTree::clusters_recursive(const Node* node,
+  const detail::Rect& cell,
+  const detail::Rect& rect,
+  uint8_t node_depth,
+  uint8_t depth,
+  std::vector<Cluster>& out_clusters) const
+{
+  float slack = detail::rect_slack(cell, rect);
+  detail::Rect outer = {
+    cell.lx - slack, cell.ly - slack, cell.hx + slack, cell.hy + slack
+  };
+  if (!detail::intersects(outer, rect) || node->summary_.count == 0) {
+    return;
+  }
+
+  if (node_depth == depth || node->is_leaf()) {
+    const Node::Summary& summary = node->summary_;
+    double count = static_cast<double>(summary.count);
+    out_clusters.push_back({
+      current_key(node),
+      summary.count,
+      static_cast<float>(summary.sum_x / count),
+      static_cast<float>(summary.sum_y / count),
+      summary.top
+    });
+    return;
+  }
+
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (node->children_[i] != nullptr) {
+      clusters_recursive(node->children_[i], child_cell(node, cell, i),
+        rect, node_depth + 1, depth, out_clusters);
+    }
+  }
+}
+
+void QuadTree::build_tree_in_place(Node* node,
+  std::vector<detail::Point*>::iterator begin,
+  std::vector<detail::Point*>::iterator end,
+  uint8_t depth)
+{
+  const std::size_t count =
+    static_cast<std::size_t>(std::distance(begin, end));
+
+  if (node == nullptr || count == 0) {
+    return;
+  }
+
+  if (count <= MAX_BLOCK_SIZE || depth == detail::keys::max_depth()) {
+    auto start = detail::Clock_t::now();
+    node->set_data(begin, end);
+    build_timings_.allocation += detail::elapsed_since(start);
+  } else {
+    auto start = detail::Clock_t::now();
+    detail::Children_t children;
+    detail::keys::compute_children(node->quad_key_, children);
+
+    // Keys are recomputed rather than stored, trading a second keying pass
+    // over misplaced points for no per-point scratch memory.
+    const uint64_t min_id = children[0];
+    std::size_t sizes[4];
+    detail::partition_by_child(begin, end,
+      [&](const detail::Point* p)
+      {
+        uint64_t c_pid = detail::compute_quad_key(*p, depth + 1,
+          global_bounds_);
+        if (detail::keys::compute_parent(c_pid) != node->quad_key_) {
+          throw std::runtime_error("A quadkey got bucketed wrong.");
+        }
+        return static_cast<std::size_t>(c_pid - min_id);
+      },
+      sizes);
+    build_timings_.partitioning += detail::elapsed_since(start);
+
+    std::vector<detail::Point*>::iterator child_begin = begin;
+    for (std::size_t i = 0; i < 4; ++i) {
+      std::vector<detail::Point*>::iterator child_end = child_begin +
+        sizes[i];
+      if (sizes[i] != 0) {
+        start = detail::Clock_t::now();
+        node->children_[i] = new Node(children[i]);
+        build_timings_.allocation += detail::elapsed_since(start);
+        build_tree_in_place(node->children_[i], child_begin, child_end,
+          depth + 1);
+      }
+      child_begin = child_end;
+    }
+  }
+
+  node->summarize();
+}
+
+void QuadTree::compute_stats_recursive(const Node* node,
+  uint8_t depth,
+  Stats& out_stats) const
+{
+  if (node == nullptr) {
+    return;
+  }
+
+  if (out_stats.nodes_per_depth.size() <= depth) {
+    out_stats.nodes_per_depth.resize(depth + 1, 0);
+  }
+  ++out_stats.nodes_per_depth[depth];
+  ++out_stats.node_count;
+  out_stats.node_bytes += sizeof(Node);
+
+  if (node->is_leaf()) {
+    std::size_t size = node->points_.size();
+    std::size_t bucket = (std::min)(LEAF_FILL_BUCKETS,
+      (size * LEAF_FILL_BUCKETS) / MAX_BLOCK_SIZE);
+    ++out_stats.leaf_fill_histogram[bucket];
+    ++out_stats.leaf_count;
+    out_stats.point_count += size;
+    out_stats.leaf_bytes += node->points_.capacity() * sizeof(detail::Point) +
+      node->groups_.capacity() * sizeof(Node::Group);
+    return;
+  }
+
+  for (const Node* child : node->children_) {
+    if (child == nullptr) {
+      ++out_stats.empty_child_count;
+    } else {
+      compute_stats_recursive(child, depth + 1, out_stats);
+    }
+  }
+}
+
+void QuadTree::query_radius_recursive(const Node* node,
+  const detail::Rect& cell,
+  float x,
+  float y,
+  float radius,
+  std::vector<detail::Point>& out_points)
+{
+  float slack = detail::rect_slack(cell, cell);
+  detail::Rect outer = {
+    cell.lx - slack, cell.ly - slack, cell.hx + slack, cell.hy + slack
+  };
+  const float radius_sq = radius * radius;
+  if (detail::min_distance_sq(outer, x, y) > radius_sq) {
+    return;
+  }
+  if (detail::max_distance_sq(outer, x, y) <= radius_sq) {
+    NullQueryTracer tracer;
+    accept_subtree(node, out_points, tracer);
+    return;
+  }
+
+  if (node->is_leaf()) {
+    for (const detail::Point& p : node->points_) {
+      float dx = p.x - x;
+      float dy = p.y - y;
+      if (dx * dx + dy * dy <= radius_sq) {
+        out_points.push_back(p);
+      }
+    }
+    return;
+  }
+
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (node->children_[i] != nullptr) {
+      query_radius_recursive(node->children_[i],
+        child_cell(node, cell, i), x, y, radius, out_points);
+    }
+  }
+}
+
+void QuadTree::spatial_join_node_pair(const NodePair& pair,
+  float distance,
+  std::vector<PointPair_t>& out_pairs)
+{
+  const float distance_sq = distance * distance;
+  std::vector<NodePair> stack = { pair };
+  while (!stack.empty()) {
+    NodePair top = stack.back();
+    stack.pop_back();
+
+    if (!detail::rects_within(top.lhs_rect, top.rhs_rect, distance)) {
+      continue;
+    }
+    if (split_node_pair(top, stack)) {
+      continue;
+    }
+
+    for (const detail::Point& lp : top.lhs->points_) {
+      for (const detail::Point& rp : top.rhs->points_) {
+        float dx = lp.x - rp.x;
+        float dy = lp.y - rp.y;
+        if (dx * dx + dy * dy <= distance_sq) {
+          out_pairs.emplace_back(lp, rp);
+        }
+      }
+    }
+  }
+}
+
+template <typename Visit>
+void QuadTree::segment_recursive(const Node* node,
+  const detail::Rect& cell,
+  const Segment& segment,
+  float& limit,
+  Visit& visit)
+{
+  if (node->is_leaf()) {
+    const float length_sq = segment.dx * segment.dx +
+      segment.dy * segment.dy;
+    const float radius_sq = segment.radius * segment.radius;
+    for (const detail::Point& p : node->points_) {
+      float px = p.x - segment.x0;
+      float py = p.y - segment.y0;
+      float t = length_sq > 0.0f ?
+        (px * segment.dx + py * segment.dy) / length_sq : 0.0f;
+      t = (std::min)((std::max)(t, 0.0f), 1.0f);
+      float ex = px - t * segment.dx;
+      float ey = py - t * segment.dy;
+      if (ex * ex + ey * ey <= radius_sq && t <= limit) {
+        visit(p, t);
+      }
+    }
+    return;
+  }
+
+  // Children whose cells, widened by the radius, the segment passes
+  // through, in the order it enters them.
+  struct Entry
+  {
+    float enter;
+    std::size_t child;
+  };
+  Entry entries[4];
+  std::size_t entry_count = 0;
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (node->children_[i] == nullptr) {
+      continue;
+    }
+    detail::Rect child = child_cell(node, cell, i);
+    float grow = segment.radius + detail::rect_slack(child, child);
+    detail::Rect box = {
+      child.lx - grow, child.ly - grow, child.hx + grow, child.hy + grow
+    };
+    float enter = 0.0f;
+    float exit = 0.0f;
+    if (detail::clip_segment(box, segment.x0, segment.y0, segment.dx,
+      segment.dy, enter, exit) && enter <= limit) {
+      std::size_t slot = entry_count++;
+      while (slot > 0 && entries[slot - 1].enter > enter) {
+        entries[slot] = entries[slot - 1];
+        --slot;
+      }
+      entries[slot] = { enter, i };
+    }
+  }
+
+  for (std::size_t i = 0; i < entry_count; ++i) {
+    if (entries[i].enter > limit) {
+      break;
+    }
+    std::size_t child = entries[i].child;
+    segment_recursive(node->children_[child],
+      child_cell(node, cell, child), segment, limit, visit);
+  }
+}
+
+bool QuadTree::split_node_pair(const NodePair& pair,
+  std::vector<NodePair>& out_pairs)
+{
+  bool lhs_leaf = pair.lhs->is_leaf();
+  bool rhs_leaf = pair.rhs->is_leaf();
+  if (lhs_leaf && rhs_leaf) {
+    return false;
+  }
+
+  // Descend into the larger of the two cells so both sides shrink at a
+  // similar rate when the trees have different bounds.
+  float lhs_extent = (pair.lhs_rect.hx - pair.lhs_rect.lx) +
+    (pair.lhs_rect.hy - pair.lhs_rect.ly);
+  float rhs_extent = (pair.rhs_rect.hx - pair.rhs_rect.lx) +
+    (pair.rhs_rect.hy - pair.rhs_rect.ly);
+  bool split_lhs = rhs_leaf || (!lhs_leaf && lhs_extent >= rhs_extent);
+
+  const Node* node = split_lhs ? pair.lhs : pair.rhs;
+  const detail::Rect& rect = split_lhs ? pair.lhs_rect : pair.rhs_rect;
+  for (std::size_t i = 0; i < 4; ++i) {
+    const Node* child = node->children_[i];
+    if (child == nullptr) {
+      continue;
+    }
+    NodePair child_pair = pair;
+    if (split_lhs) {
+      child_pair.lhs = child;
+      child_pair.lhs_rect = child_cell(node, rect, i);
+    } else {
+      child_pair.rhs = child;
+      child_pair.rhs_rect = child_cell(node, rect, i);
+    }
+    out_pairs.push_back(child_pair);
   }
+  return true;
 }
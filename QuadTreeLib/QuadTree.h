@@ -1,21 +1,39 @@
 #ifndef QUAD_TREE_H
 #define QUAD_TREE_H
 
+#include "QuadKey.h"
+#include "QueryTrace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <iosfwd>
+#include <iterator>
+#include <span>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace detail
 {
-  #pragma pack(push, 1)
+  // Naturally aligned. Change logs and checkpoints write the fields one by
+  // one, so the padding after y never reaches them.
   struct __declspec(dllexport) Point
   {
-    int8_t id;
+    // Caller assigned identity. Ids must be unique within a tree that has
+    // its id index enabled.
+    int64_t id;
     int32_t rank;
     float x;
     float y;
   };
 
+  // The id index hashes and binds references to Point::id in place.
+  static_assert(alignof(Point) == alignof(int64_t),
+    "Point must not be packed.");
+
   struct __declspec(dllexport) Rect
   {
     float lx;
@@ -23,7 +41,6 @@ namespace detail
     float hx;
     float hy;
   };
-  #pragma pack(pop)
 
   __declspec(dllexport) uint8_t _stdcall msb32(uint32_t x);
 
@@ -48,17 +65,165 @@ namespace detail
 
   __declspec(dllexport) bool _stdcall is_valid(uint64_t quad_key);
 
-  typedef uint64_t Children_t[4];
   __declspec(dllexport) void _stdcall compute_children(uint64_t parent,
     Children_t& children);
 
   __declspec(dllexport) uint64_t _stdcall compute_parent(uint64_t child);
+
+  // Inclusive interval of quad keys.
+  struct __declspec(dllexport) KeyRange
+  {
+    uint64_t lo;
+    uint64_t hi;
+  };
+
+  // Replaces out_ranges with disjoint, ascending [lo, hi] ranges of keys at
+  // depth, holding every key that compute_quad_key gives a point inside
+  // both rect and bounds. Sibling cells are merged into their parent's
+  // range wherever rect covers all of them. Cells on rect's boundary are
+  // split level by level only while the ranges fit in max_ranges; the rest
+  // stay whole, which adds keys outside of rect but never drops one inside
+  // it. A max_ranges of 0 means no limit.
+  __declspec(dllexport) void _stdcall compute_key_ranges(const Rect& rect,
+    const Rect& bounds,
+    uint8_t depth,
+    std::size_t max_ranges,
+    std::vector<KeyRange>& out_ranges);
+
+  inline bool intersects(const Rect& a, const Rect& b)
+  {
+    return a.lx <= b.hx && b.lx <= a.hx && a.ly <= b.hy && b.ly <= a.hy;
+  }
+
+  inline bool contains(const Rect& r, const Point& p)
+  {
+    return p.x >= r.lx && p.x <= r.hx && p.y >= r.ly && p.y <= r.hy;
+  }
+
+  // Whether a and b are the same point in every field.
+  inline bool same_point(const Point& a, const Point& b)
+  {
+    return a.id == b.id && a.rank == b.rank && a.x == b.x && a.y == b.y;
+  }
+
+  // Rect of child child_index of parent, whose children meet at
+  // (mid_x, mid_y).
+  inline Rect child_rect(const Rect& parent,
+    std::size_t child_index,
+    float mid_x,
+    float mid_y)
+  {
+    Rect ret = parent;
+    if (child_index & 0x1) {
+      ret.lx = mid_x;
+    } else {
+      ret.hx = mid_x;
+    }
+    if (child_index & 0x2) {
+      ret.ly = mid_y;
+    } else {
+      ret.hy = mid_y;
+    }
+    return ret;
+  }
+
+  inline Rect child_rect(const Rect& parent, std::size_t child_index)
+  {
+    return child_rect(parent, child_index,
+      parent.lx + (parent.hx - parent.lx) * 0.5f,
+      parent.ly + (parent.hy - parent.ly) * 0.5f);
+  }
+
+  // Index of the child of cell, whose children meet at (mid_x, mid_y),
+  // that p falls in, child kept taking every point of its closed rect,
+  // edges included, and the others splitting the rest as child_index does.
+  inline std::size_t child_index(const Rect& cell,
+    const Point& p,
+    float mid_x,
+    float mid_y,
+    std::size_t kept)
+  {
+    if (contains(child_rect(cell, kept, mid_x, mid_y), p)) {
+      return kept;
+    }
+    return (p.x >= mid_x ? 0x1 : 0x0) | (p.y >= mid_y ? 0x2 : 0x0);
+  }
+
+  inline float min_distance_sq(const Rect& r, float x, float y)
+  {
+    float dx = (std::max)({ 0.0f, r.lx - x, x - r.hx });
+    float dy = (std::max)({ 0.0f, r.ly - y, y - r.hy });
+    return dx * dx + dy * dy;
+  }
+
+  inline float max_distance_sq(const Rect& r, float x, float y)
+  {
+    float dx = (std::max)(std::abs(x - r.lx), std::abs(x - r.hx));
+    float dy = (std::max)(std::abs(y - r.ly), std::abs(y - r.hy));
+    return dx * dx + dy * dy;
+  }
+
+  // Index of the child of cell whose rect p falls in, matching the halves
+  // produced by child_rect.
+  inline std::size_t child_index(const Rect& cell, const Point& p)
+  {
+    float mid_x = cell.lx + (cell.hx - cell.lx) * 0.5f;
+    float mid_y = cell.ly + (cell.hy - cell.ly) * 0.5f;
+    return (p.x >= mid_x ? 0x1 : 0x0) | (p.y >= mid_y ? 0x2 : 0x0);
+  }
+
+  // Quad keys are computed in single precision, so a point can land a few
+  // ulps outside of the rect its cell was halved down to. Pruning tests
+  // widen cells by this much so they never drop a real match.
+  inline float rect_slack(const Rect& a, const Rect& b)
+  {
+    float magnitude = (std::max)({
+      std::abs(a.lx), std::abs(a.hx), std::abs(a.ly), std::abs(a.hy),
+      std::abs(b.lx), std::abs(b.hx), std::abs(b.ly), std::abs(b.hy) });
+    return magnitude * 1e-6f;
+  }
+
+  // Reorders [begin, end) in place so the elements of child 0, 1, 2 and 3
+  // follow one another, writing the size of each run to out_sizes.
+  // child_of maps an element to its child index and is called between one
+  // and two times per element; no memory is allocated.
+  template <typename Iterator, typename ChildOf>
+  void partition_by_child(Iterator begin, Iterator end, ChildOf child_of,
+    std::size_t (&out_sizes)[4])
+  {
+    std::fill(std::begin(out_sizes), std::end(out_sizes), 0);
+    for (Iterator it = begin; it != end; ++it) {
+      ++out_sizes[child_of(*it)];
+    }
+
+    Iterator heads[4];
+    Iterator tails[4];
+    heads[0] = begin;
+    for (std::size_t i = 0; i < 4; ++i) {
+      tails[i] = heads[i] + out_sizes[i];
+      if (i < 3) {
+        heads[i + 1] = tails[i];
+      }
+    }
+
+    for (std::size_t i = 0; i < 4; ++i) {
+      while (heads[i] != tails[i]) {
+        std::size_t child = child_of(*heads[i]);
+        if (child == i) {
+          ++heads[i];
+        } else {
+          std::iter_swap(heads[i], heads[child]++);
+        }
+      }
+    }
+  }
 }
 
+class ChangeLog;
+
 class __declspec(dllexport) QuadTree
 {
-public:
-  
+  friend class QueryExecutor;
 
 private:
   struct __declspec(dllexport) Node
@@ -70,7 +235,7 @@ private:
       UpperRight = 3
     };
 
-    explicit Node(uint64_t quad_key);
+    explicit Node(uint64_t quad_key, uint8_t key_epoch = 0);
 
     ~Node();
 
@@ -80,29 +245,424 @@ private:
 
     void set_child(const ChildId id, Node* child);
 
+    bool is_leaf() const;
+
+    // Recomputes summary_ from points_ for a leaf, or from the children's
+    // summaries otherwise.
+    void summarize();
+
+    void add_to_summary(const detail::Point& point);
+
+    // Aggregate of every point below the node, kept up to date by the
+    // constructor and by insert.
+    struct Summary
+    {
+      uint64_t count;
+      double sum_x;
+      double sum_y;
+      detail::Point top;
+      // Generation of the oldest expiring point, or NO_EXPIRY.
+      uint64_t oldest_generation;
+      // Levels from the node down to its deepest leaf.
+      uint8_t height;
+    };
+
+    // Run of a leaf's points that expire in the same generation.
+    struct Group
+    {
+      uint64_t generation;
+      // One past the group's last point in points_.
+      std::size_t end;
+    };
+
     uint64_t quad_key_;
+    // Number of times the root had grown when quad_key_ was computed. See
+    // QuadTree::current_key.
+    uint8_t key_epoch_;
+    Summary summary_;
     std::vector<detail::Point> points_;
+    // Groups of the expiring points, which come first in points_, oldest
+    // generation first. The points past the last group never expire.
+    std::vector<Group> groups_;
     Node* children_[4];
+    // Set on a root made by QuadTree::grow, whose children meet at the old
+    // root's corner (split_x_, split_y_) rather than at the middle of its
+    // cell, so the old root keeps its cell exactly. Halving the grown cell
+    // back down rounds, and would move points across the old root's edges.
+    bool has_split_;
+    // Slot of the old root, which keeps the points on its edges.
+    uint8_t kept_child_;
+    float split_x_;
+    float split_y_;
+  };
+
+  typedef std::pair<std::size_t, std::size_t> Span_t;
+
+  // A point with its expiry generation.
+  typedef std::pair<uint64_t, detail::Point> AgedPoint_t;
+
+  typedef std::pair<uint64_t, AgedPoint_t> KeyedPoint_t;
+
+  // Where a point lives: its leaf, and its index in the leaf's points_.
+  struct Slot
+  {
+    Node* leaf;
+    std::size_t index;
+  };
+
+  typedef std::unordered_map<int64_t, Slot> IdIndex_t;
+
+  // Every point of the tree laid out leaf by leaf, with, for each leaf, the
+  // spans of the points of the leaves within a radius of it.
+  struct Neighbourhoods
+  {
+    std::vector<float> xs;
+    std::vector<float> ys;
+    std::vector<Span_t> leaves;
+    std::vector<std::vector<Span_t>> candidates;
+  };
+
+  // Segment from (x0, y0) to (x0 + dx, y0 + dy), widened by radius.
+  struct Segment
+  {
+    float x0;
+    float y0;
+    float dx;
+    float dy;
+    float radius;
+  };
+
+  struct NodePair
+  {
+    const Node* lhs;
+    detail::Rect lhs_rect;
+    const Node* rhs;
+    detail::Rect rhs_rect;
   };
 
 public:
   constexpr static std::size_t MAX_BLOCK_SIZE = 1000ull;
 
+  constexpr static std::size_t LEAF_FILL_BUCKETS = 10ull;
+
+  constexpr static int32_t NOISE = -1;
+
+  constexpr static uint64_t NO_EXPIRY = UINT64_MAX;
+
+  typedef std::pair<detail::Point, detail::Point> PointPair_t;
+
+  // Wall time spent in each phase of the constructor.
+  struct __declspec(dllexport) BuildTimings
+  {
+    std::chrono::nanoseconds bounds;
+    std::chrono::nanoseconds keying;
+    std::chrono::nanoseconds partitioning;
+    std::chrono::nanoseconds allocation;
+  };
+
+  // Representative of every point in one cell.
+  struct __declspec(dllexport) Cluster
+  {
+    uint64_t quad_key;
+    uint64_t count;
+    // Centroid of the cell's points.
+    float x;
+    float y;
+    // The cell's point with the highest rank.
+    detail::Point top;
+  };
+
+  struct __declspec(dllexport) Stats
+  {
+    // Slot i holds the number of nodes at depth i.
+    std::vector<std::size_t> nodes_per_depth;
+    // Slot i holds the number of leaves filled to [i, i + 1) tenths of
+    // MAX_BLOCK_SIZE. The last slot counts leaves holding MAX_BLOCK_SIZE
+    // points or more. A leaf can hold exactly MAX_BLOCK_SIZE at any depth,
+    // and more only at detail::max_depth().
+    std::vector<std::size_t> leaf_fill_histogram;
+    std::size_t node_count;
+    std::size_t leaf_count;
+    std::size_t point_count;
+    // Null child slots of internal nodes, and their share of all of the
+    // child slots of internal nodes.
+    std::size_t empty_child_count;
+    double empty_child_ratio;
+    std::size_t node_bytes;
+    // Capacity of the leaves' points and of their expiry groups.
+    std::size_t leaf_bytes;
+    std::size_t total_bytes;
+    BuildTimings build_timings;
+  };
+
+  enum class BuildMode {
+    // Each level copies its pointers into four child buckets, leaving the
+    // input range untouched.
+    Buffered,
+    // Each level partitions its range of the input in place, so the build
+    // allocates nothing besides the tree itself. The order of the pointers
+    // in [begin, end) is changed.
+    InPlace
+  };
+
+  // Finger into one tree for a stream of nearby queries, such as a map
+  // being panned. It keeps the path to the node the last query started
+  // from, climbs only to the common ancestor of that node and the next
+  // query's cell, found by compute_parent arithmetic on their quad keys,
+  // and descends from there. A cursor belongs to one thread; any number of
+  // cursors may share a tree. Mutating the tree resets its cursors.
+  class __declspec(dllexport) Cursor
+  {
+  public:
+    explicit Cursor(const QuadTree& tree);
+
+    // Appends every point inside rect, bounds inclusive, to out_points.
+    void query(const detail::Rect& rect,
+      std::vector<detail::Point>& out_points);
+
+    // As above, reporting the work done to tracer.
+    template <typename Tracer>
+    void query(const detail::Rect& rect,
+      std::vector<detail::Point>& out_points,
+      Tracer& tracer);
+
+    // Quad key of the node the last query started from, or 0 before the
+    // first query.
+    uint64_t finger_key() const;
+
+    void reset();
+
+  private:
+    struct Step
+    {
+      const Node* node;
+      detail::Rect cell;
+      uint64_t quad_key;
+    };
+
+    // Moves the finger to the deepest node whose cell holds all of rect,
+    // or returns nullptr when rect misses the tree.
+    const Step* seek(const detail::Rect& rect);
+
+    const QuadTree& tree_;
+    uint64_t mutation_count_;
+    std::vector<Step> path_;
+  };
+
   QuadTree(
     std::vector<detail::Point *>::iterator begin,
-    std::vector<detail::Point *>::iterator end);
+    std::vector<detail::Point *>::iterator end,
+    BuildMode mode = BuildMode::Buffered);
+
+  // Takes over other's nodes, bounds and change log, leaving other empty.
+  QuadTree(QuadTree&& other);
 
   ~QuadTree();
 
+  // Combines two trees into one, leaving both empty. When both have the
+  // same global bounds their nodes line up cell for cell: a subtree that
+  // only one of them has is moved over whole, and points are only moved
+  // where both have data, into the deeper side's leaves. Otherwise every
+  // point is keyed against the union of their bounds, each tree's keys are
+  // sorted and merged, and the result is built from the merged run. The
+  // result has no change log attached and no id index.
+  static QuadTree merge(QuadTree&& lhs, QuadTree&& rhs);
+
   const detail::Rect& global_bounds() const;
 
   uint8_t max_depth() const;
 
+  // Adds point to the tree, splitting its leaf once it holds more than
+  // MAX_BLOCK_SIZE points. A point outside of global_bounds() grows the
+  // root instead of rebuilding: each step adds a parent level with twice
+  // the extent, toward the point, and moves no points. Throws if a step
+  // would push the deepest leaf past detail::max_depth(), or, with the id
+  // index enabled, if a point with the same id is already in the tree.
+  void insert(const detail::Point& point);
+
+  // As above, for a point that expire drops once now reaches expires_at.
+  // Expiry times are grouped into generations of generation_span() units,
+  // so a point can outlive its expiry by up to one generation.
+  void insert(const detail::Point& point, uint64_t expires_at);
+
+  // Drops every generation whose points have all expired by now. Subtrees
+  // with nothing that old are skipped, each leaf drops its expired groups
+  // from the front of its points in one erase, and siblings left with no
+  // more than MAX_BLOCK_SIZE points between them are collapsed into their
+  // parent. Returns the number of points dropped.
+  std::size_t expire(uint64_t now);
+
+  // Sets the length of an expiry generation in the caller's time units,
+  // 1 by default. Throws if span is 0 or the tree holds expiring points.
+  void set_generation_span(uint64_t span);
+
+  uint64_t generation_span() const;
+
+  // Removes one point equal to point in every field, returning false if
+  // there is none. A leaf left empty is deleted, as is every ancestor left
+  // without children.
+  bool erase(const detail::Point& point);
+
+  // Moves one point equal to point in every field to (x, y), growing the
+  // root as insert does. The point keeps its expiry generation. Returns
+  // false if there is no such point.
+  bool move(const detail::Point& point, float x, float y);
+
+  // Attaches log, which then receives a record for every mutation of the
+  // tree, or detaches the current log when given nullptr. The tree does
+  // not own log.
+  void set_change_log(ChangeLog* log);
+
+  // Builds an index from point id to leaf and slot, kept up to date by
+  // every later mutation, or drops it when enabled is false. Throws if two
+  // points share an id, leaving the index disabled.
+  void set_id_index(bool enabled);
+
+  bool has_id_index() const;
+
+  // Copies the point with id into out_point, returning false if there is
+  // none. Requires the id index.
+  bool find(int64_t id, detail::Point& out_point) const;
+
+  // Removes the point with id, returning false if there is none. Requires
+  // the id index, which names the leaf, so no spatial search or scan is
+  // needed.
+  bool erase(int64_t id);
+
+  // Moves the point with id to (x, y) as move(point, x, y) does, returning
+  // false if there is none. Requires the id index.
+  bool move(int64_t id, float x, float y);
+
+  // Replays records from another tree's ChangeLog. The tree must be in the
+  // state the other tree was in when the first record was written: empty,
+  // restored from the checkpoint preceding them, or fed the same records
+  // up to that point. Records are forwarded to an attached log as is.
+  void apply_log(std::span<const uint8_t> records);
+
+  // Writes the tree's bounds, growth history and nodes, leaves with their
+  // points, in host byte order.
+  void write_checkpoint(std::ostream& out) const;
+
+  // Replaces the content of the tree with a checkpoint written by
+  // write_checkpoint.
+  void read_checkpoint(std::istream& in);
+
+  void compute_stats(Stats& out_stats) const;
+
+  // Appends one cluster for every populated cell at depth that overlaps
+  // rect. Clusters are precomputed per node, so no leaf points are read.
+  // Where the tree stops above depth the leaf's own cluster is returned in
+  // its place, covering at most MAX_BLOCK_SIZE points.
+  void clusters(const detail::Rect& rect,
+    uint8_t depth,
+    std::vector<Cluster>& out_clusters) const;
+
+  // Appends every point inside rect, bounds inclusive, to out_points.
+  void query(const detail::Rect& rect,
+    std::vector<detail::Point>& out_points) const;
+
+  // As above, reporting the work done to tracer. Tracer is a policy with
+  // the hooks of NullQueryTracer; passing a QueryTracer counts the work.
+  template <typename Tracer>
+  void query(const detail::Rect& rect,
+    std::vector<detail::Point>& out_points,
+    Tracer& tracer) const;
+
+  // Appends every point within radius of (x, y), boundary inclusive.
+  void query_radius(float x,
+    float y,
+    float radius,
+    std::vector<detail::Point>& out_points) const;
+
+  // Appends every point within radius of the segment from (x0, y0) to
+  // (x1, y1), boundary inclusive, to out_points: a capsule 2 * radius
+  // wide, or the bare segment for a radius of 0. Only the cells the capsule
+  // passes through are visited, children in the order the segment enters
+  // them, so points come out leaf by leaf along the segment.
+  void query_segment(float x0,
+    float y0,
+    float x1,
+    float y1,
+    float radius,
+    std::vector<detail::Point>& out_points) const;
+
+  // Finds the point within radius of the segment from (x0, y0) to
+  // (x1, y1) whose projection onto it lies nearest (x0, y0), the first
+  // point a ray cast from there would hit. Cells are visited in the order
+  // the segment enters them, and the walk stops at the first cell entered
+  // past the best hit so far. Returns false when there is no such point.
+  bool first_hit(float x0,
+    float y0,
+    float x1,
+    float y1,
+    float radius,
+    detail::Point& out_point) const;
+
+  // Replaces out_points with the k points nearest to (x, y), nearest
+  // first. Cells are visited best first by their distance to (x, y).
+  void nearest(float x,
+    float y,
+    std::size_t k,
+    std::vector<detail::Point>& out_points) const;
+
+  // Key of the leaf whose cell holds (x, y), or 0 when the tree is empty
+  // or (x, y) is outside of global_bounds().
+  uint64_t leaf_key(float x, float y) const;
+
+  // Appends the key of every leaf bordering leaf_key's cell in direction:
+  // the single leaf as large or larger than it, or every smaller leaf
+  // along the shared edge or corner. Nothing is appended at the edge of
+  // the tree or where the bordering cell holds no points.
+  void neighbour_leaves(uint64_t leaf_key,
+    detail::keys::Direction direction,
+    std::vector<uint64_t>& out_keys) const;
+
+  // Appends the points of the leaf named by leaf_key, if it is one.
+  void leaf_points(uint64_t leaf_key,
+    std::vector<detail::Point>& out_points) const;
+
+  // Emits every (this, other) pair of points that lie within distance of
+  // each other. Both trees are walked together in world coordinates, so
+  // their global bounds do not need to match. A thread_count of 0 uses
+  // std::thread::hardware_concurrency().
+  void spatial_join(const QuadTree& other,
+    float distance,
+    std::vector<PointPair_t>& out_pairs,
+    std::size_t thread_count = 0) const;
+
+  // Replaces out_points with every point of the tree, leaf by leaf, and
+  // out_counts with the number of points within radius of each, the point
+  // itself included. Each leaf gathers the leaves whose cells lie within
+  // radius of its own and runs the distance kernel over their coordinates;
+  // leaves are spread over thread_count threads, 0 meaning
+  // std::thread::hardware_concurrency().
+  void neighbour_counts(float radius,
+    std::vector<detail::Point>& out_points,
+    std::vector<uint32_t>& out_counts,
+    std::size_t thread_count = 0) const;
+
+  // DBSCAN over the tree. Replaces out_points with every point, as
+  // neighbour_counts does, and out_labels with each point's cluster, from 0
+  // in order of first appearance, or NOISE. A point with at least
+  // min_points points within radius, itself included, is a core point.
+  // Core points within radius of each other are merged with a concurrent
+  // union-find, and every other point joins the cluster of the first core
+  // point found within radius of it.
+  void dbscan(float radius,
+    std::size_t min_points,
+    std::vector<detail::Point>& out_points,
+    std::vector<int32_t>& out_labels,
+    std::size_t thread_count = 0) const;
+
   static void compute_bounds(
     std::vector<detail::Point *>::iterator begin,
     std::vector<detail::Point *>::iterator end,
     detail::Rect& out_rect);
 
+  static void compute_bounds(
+    std::span<const detail::Point> points,
+    detail::Rect& out_rect);
+
 private:
   inline std::size_t compute_points_size(const detail::Point* start_point,
     const detail::Point* end_point)
@@ -115,12 +675,342 @@ private:
     std::vector<detail::Point *>::iterator end,
     uint8_t depth);
 
-  int8_t max_depth_recursive(const Node* node) const;
+  void build_tree_in_place(Node* node,
+    std::vector<detail::Point *>::iterator begin,
+    std::vector<detail::Point *>::iterator end,
+    uint8_t depth);
+
+  // Builds the subtree of node from [begin, end), sorted by their key at
+  // detail::max_depth(), whose key at node's depth is node's.
+  void build_sorted(Node* node,
+    std::vector<KeyedPoint_t>::const_iterator begin,
+    std::vector<KeyedPoint_t>::const_iterator end,
+    uint8_t depth);
+
+  // Adds point to the tree in generation, logging it.
+  void add(const detail::Point& point, uint64_t generation);
+
+  // Drops every group older than first_live below node, returning the
+  // number of points dropped.
+  std::size_t expire_recursive(Node* node, uint64_t first_live);
+
+  // Replaces the points of leaf with items, grouping them by generation,
+  // and summarizes and indexes it.
+  void assign_points(Node* leaf, std::vector<AgedPoint_t>& items);
+
+  // Appends the points of leaf, with their generations, to out_items.
+  static void leaf_items(const Node* leaf,
+    std::vector<AgedPoint_t>& out_items);
+
+  static void subtree_items(const Node* node,
+    std::vector<AgedPoint_t>& out_items);
+
+  // Merges from into into, both covering cell, and returns the node that
+  // takes their place; the other is deleted.
+  Node* merge_nodes(Node* into,
+    Node* from,
+    const detail::Rect& cell,
+    uint64_t quad_key,
+    uint8_t depth);
+
+  // Adds items, all inside cell, to the subtree of node, splitting the
+  // leaves that fill up.
+  void merge_points(Node* node,
+    std::vector<AgedPoint_t>&& items,
+    const detail::Rect& cell,
+    uint64_t quad_key,
+    uint8_t depth);
+
+  // Points id_index_ at every point of leaf from slot first on.
+  void index_leaf(Node* leaf, std::size_t first = 0);
+
+  // Adds every point below node to out_index, throwing on a repeated id.
+  static void index_subtree(Node* node, IdIndex_t& out_index);
+
+  // Gives node and its subtree their keys under this tree's growth history,
+  // node's being quad_key.
+  void adopt(Node* node, uint64_t quad_key);
+
+  // Raises the heights of the ancestors of the node quad_key to cover
+  // its own, after it has been split.
+  void raise_heights(uint64_t quad_key);
+
+  // Cell of node's child i, node's own cell being cell. Every descent goes
+  // through child_cell and child_slot, so grown roots split where they
+  // were made to.
+  static detail::Rect child_cell(const Node* node,
+    const detail::Rect& cell,
+    std::size_t i);
+
+  // Index of node's child whose cell p falls in, node's own cell being
+  // cell.
+  static std::size_t child_slot(const Node* node,
+    const detail::Rect& cell,
+    const detail::Point& p);
+
+  // Cell of the node or empty child slot quad_key, found by descending
+  // from the root.
+  detail::Rect key_cell(uint64_t quad_key) const;
+
+  // Whether the grown roots of a and b split their cells at the same
+  // points, so that their nodes cover the same cells position by position.
+  static bool same_splits(const Node* a, const Node* b);
+
+  void grow_toward(const detail::Point& point);
+
+  void grow(uint8_t quadrant, const detail::Rect& bounds);
+
+  // Key of the leaf that insert would put point in: an existing leaf, or
+  // the missing child of an internal node.
+  uint64_t placement_key(const detail::Point& point) const;
+
+  // Adds point to the leaf quad_key in generation, creating the leaf if
+  // it is missing, and returns it with its cell.
+  Node* insert_at(uint64_t quad_key,
+    const detail::Point& point,
+    uint64_t generation,
+    detail::Rect& out_cell);
+
+  // Key of the leaf holding a point equal to point in every field, or 0.
+  // Bucketing by key and descending by cell can round a point on a cell
+  // edge to different sides, so every leaf whose cell is within
+  // detail::rect_slack of point is searched.
+  // With the id index enabled the leaf is looked up by id instead.
+  uint64_t locate(const detail::Point& point) const;
+
+  static uint64_t locate_recursive(const Node* node,
+    const detail::Rect& cell,
+    uint64_t quad_key,
+    const detail::Point& point);
+
+  // Removes point from the leaf quad_key, writing its generation to
+  // out_generation.
+  bool erase_at(uint64_t quad_key,
+    const detail::Point& point,
+    uint64_t& out_generation);
+
+  // Splits leaf once it holds more than MAX_BLOCK_SIZE points, logging the
+  // split.
+  void split_if_full(Node* leaf, const detail::Rect& cell, uint64_t quad_key);
+
+  static void write_node(std::ostream& out, const Node* node);
+
+  static Node* read_node(std::istream& in,
+    uint64_t quad_key,
+    uint8_t depth,
+    uint8_t key_epoch);
+
+  uint64_t current_key(const Node* node) const;
+
+  uint64_t refresh_key(Node* node);
+
+  void split_leaf(Node* node, const detail::Rect& cell, uint8_t depth);
+
+  void clusters_recursive(const Node* node,
+    const detail::Rect& cell,
+    const detail::Rect& rect,
+    uint8_t node_depth,
+    uint8_t depth,
+    std::vector<Cluster>& out_clusters) const;
+
+  // Deepest node on the path to quad_key, stopping early at a leaf, and
+  // its key in out_key. Null when the path reaches an empty child slot.
+  const Node* find_node(uint64_t quad_key, uint64_t& out_key) const;
+
+  // Appends the leaves below node whose cells touch the side or corner of
+  // node facing away from (dx, dy).
+  static void facing_leaves(const Node* node,
+    uint64_t quad_key,
+    int dx,
+    int dy,
+    std::vector<uint64_t>& out_keys);
+
+  void compute_stats_recursive(const Node* node,
+    uint8_t depth,
+    Stats& out_stats) const;
+
+  template <typename Tracer>
+  static void query_recursive(const Node* node,
+    const detail::Rect& cell,
+    const detail::Rect& rect,
+    std::vector<detail::Point>& out_points,
+    Tracer& tracer);
+
+  static void query_radius_recursive(const Node* node,
+    const detail::Rect& cell,
+    float x,
+    float y,
+    float radius,
+    std::vector<detail::Point>& out_points);
+
+  template <typename Tracer>
+  static void accept_subtree(const Node* node,
+    std::vector<detail::Point>& out_points,
+    Tracer& tracer);
+
+  void build_neighbourhoods(float radius,
+    std::size_t thread_count,
+    std::vector<detail::Point>& out_points,
+    Neighbourhoods& out_neighbourhoods) const;
+
+  static void count_neighbours(const Neighbourhoods& neighbourhoods,
+    float radius,
+    std::size_t thread_count,
+    std::vector<uint32_t>& out_counts);
+
+  static void collect_leaves(const Node* node,
+    std::vector<detail::Point>& out_points,
+    std::vector<const Node*>& out_leaves,
+    std::vector<detail::Rect>& out_cells,
+    const detail::Rect& cell);
+
+  static void leaves_within(const Node* node,
+    const detail::Rect& cell,
+    const detail::Rect& target,
+    float radius,
+    std::vector<const Node*>& out_leaves);
+
+  // Calls visit(point, t) for every point within segment.radius of
+  // segment, t being the position of its projection along the segment,
+  // from 0 to 1. Cells the segment enters past limit are skipped, and
+  // visit may lower limit.
+  template <typename Visit>
+  static void segment_recursive(const Node* node,
+    const detail::Rect& cell,
+    const Segment& segment,
+    float& limit,
+    Visit& visit);
+
+  static void spatial_join_node_pair(const NodePair& pair,
+    float distance,
+    std::vector<PointPair_t>& out_pairs);
+
+  static bool split_node_pair(const NodePair& pair,
+    std::vector<NodePair>& out_pairs);
 
 private:
   Node* root_;
   detail::Rect global_bounds_;
+  BuildTimings build_timings_;
+  // Quadrant of the new root that the old root moved into, one entry per
+  // call to grow_toward.
+  std::vector<uint8_t> growth_directions_;
+  ChangeLog* change_log_;
+  // Bumped by every mutation, so cursors can tell their path is stale.
+  uint64_t mutation_count_;
+  bool id_index_enabled_;
+  IdIndex_t id_index_;
+  uint64_t generation_span_;
 };
 
+inline detail::Rect QuadTree::child_cell(const Node* node,
+  const detail::Rect& cell,
+  std::size_t i)
+{
+  if (node->has_split_) {
+    return detail::child_rect(cell, i, node->split_x_, node->split_y_);
+  }
+  return detail::child_rect(cell, i);
+}
+
+inline std::size_t QuadTree::child_slot(const Node* node,
+  const detail::Rect& cell,
+  const detail::Point& p)
+{
+  if (node->has_split_) {
+    return detail::child_index(cell, p, node->split_x_, node->split_y_,
+      node->kept_child_);
+  }
+  return detail::child_index(cell, p);
+}
+
+template <typename Tracer>
+void QuadTree::query(const detail::Rect& rect,
+  std::vector<detail::Point>& out_points,
+  Tracer& tracer) const
+{
+  tracer.begin();
+  if (root_ != nullptr) {
+    query_recursive(root_, global_bounds_, rect, out_points, tracer);
+  }
+  tracer.end();
+}
+
+template <typename Tracer>
+void QuadTree::Cursor::query(const detail::Rect& rect,
+  std::vector<detail::Point>& out_points,
+  Tracer& tracer)
+{
+  tracer.begin();
+  const Step* step = seek(rect);
+  if (step != nullptr) {
+    query_recursive(step->node, step->cell, rect, out_points, tracer);
+  }
+  tracer.end();
+}
+
+template <typename Tracer>
+void QuadTree::query_recursive(const Node* node,
+  const detail::Rect& cell,
+  const detail::Rect& rect,
+  std::vector<detail::Point>& out_points,
+  Tracer& tracer)
+{
+  tracer.visit_node();
+
+  float slack = detail::rect_slack(cell, rect);
+  detail::Rect outer = {
+    cell.lx - slack, cell.ly - slack, cell.hx + slack, cell.hy + slack
+  };
+  if (!detail::intersects(outer, rect)) {
+    return;
+  }
+  if (rect.lx <= outer.lx && rect.ly <= outer.ly &&
+    rect.hx >= outer.hx && rect.hy >= outer.hy) {
+    tracer.accept_subtree();
+    accept_subtree(node, out_points, tracer);
+    return;
+  }
+
+  if (node->is_leaf()) {
+    tracer.scan_leaf();
+    tracer.test_points(node->points_.size());
+    std::size_t emitted = 0;
+    for (const detail::Point& p : node->points_) {
+      if (detail::contains(rect, p)) {
+        out_points.push_back(p);
+        ++emitted;
+      }
+    }
+    tracer.emit_points(emitted);
+    return;
+  }
+
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (node->children_[i] != nullptr) {
+      query_recursive(node->children_[i], child_cell(node, cell, i), rect,
+        out_points, tracer);
+    }
+  }
+}
+
+template <typename Tracer>
+void QuadTree::accept_subtree(const Node* node,
+  std::vector<detail::Point>& out_points,
+  Tracer& tracer)
+{
+  if (node->is_leaf()) {
+    out_points.insert(out_points.end(), node->points_.begin(),
+      node->points_.end());
+    tracer.emit_points(node->points_.size());
+    return;
+  }
+  for (const Node* child : node->children_) {
+    if (child != nullptr) {
+      accept_subtree(child, out_points, tracer);
+    }
+  }
+}
+
 #endif
 
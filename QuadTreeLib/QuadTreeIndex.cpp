@@ -0,0 +1,362 @@
+#include "QuadTreeIndex.h"
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+QuadTreeIndex::Node::Node(uint64_t quad_key) :
+  quad_key_(quad_key),
+  begin_(0),
+  end_(0),
+  children_()
+{}
+
+QuadTreeIndex::Node::~Node()
+{
+  for (Node* child : children_) {
+    delete child;
+  }
+}
+
+bool QuadTreeIndex::Node::is_leaf() const
+{
+  return children_[0] == nullptr && children_[1] == nullptr &&
+    children_[2] == nullptr && children_[3] == nullptr;
+}
+
+QuadTreeIndex::QuadTreeIndex(std::span<const detail::Point> points) :
+  points_(points),
+  permutation_(),
+  root_(nullptr),
+  global_bounds_({})
+{
+  if (points.empty()) {
+    return;
+  }
+  if (points.size() > (std::numeric_limits<uint32_t>::max)()) {
+    throw std::runtime_error("QuadTreeIndex holds at most 2^32 - 1 points.");
+  }
+
+  build();
+}
+
+QuadTreeIndex::~QuadTreeIndex()
+{
+  delete root_;
+}
+
+std::span<const detail::Point> QuadTreeIndex::points() const
+{
+  return points_;
+}
+
+const detail::Rect& QuadTreeIndex::global_bounds() const
+{
+  return global_bounds_;
+}
+
+uint8_t QuadTreeIndex::max_depth() const
+{
+  return max_depth_recursive(root_);
+}
+
+void QuadTreeIndex::query(const detail::Rect& rect,
+  std::vector<uint32_t>& out_indices) const
+{
+  if (root_ != nullptr) {
+    query_recursive(root_, global_bounds_, rect, out_indices);
+  }
+}
+
+void QuadTreeIndex::update_positions(std::span<const detail::Point> points)
+{
+  if (points.size() != points_.size()) {
+    throw std::runtime_error("Updated points must match the indexed points.");
+  }
+  points_ = points;
+  if (root_ == nullptr) {
+    return;
+  }
+
+  for (const detail::Point& p : points_) {
+    if (!detail::contains(global_bounds_, p)) {
+      delete root_;
+      root_ = nullptr;
+      build();
+      return;
+    }
+  }
+
+  std::vector<uint32_t> sources;
+  std::vector<Move> moves;
+  SizeDeltas_t deltas;
+  find_moves(root_, 0u, sources, moves, deltas);
+  if (moves.empty()) {
+    return;
+  }
+
+  // Rewrite only the window of the permutation between the first and the
+  // last slot that loses or gains a point. Stayers keep their relative
+  // order and each mover lands at the end of its target leaf's old range.
+  std::stable_sort(moves.begin(), moves.end(),
+    [](const Move& lhs, const Move& rhs)
+    {
+      if (lhs.target != rhs.target) {
+        return lhs.target < rhs.target;
+      }
+      return lhs.leaf_order < rhs.leaf_order;
+    });
+  uint32_t lo = (std::min)(sources.front(), moves.front().target);
+  uint32_t hi = (std::max)(sources.back() + 1, moves.back().target);
+
+  std::vector<uint32_t> window;
+  window.reserve(hi - lo);
+  auto source = sources.begin();
+  auto move = moves.begin();
+  for (uint32_t slot = lo; slot < hi; ++slot) {
+    for (; move != moves.end() && move->target == slot; ++move) {
+      window.push_back(move->index);
+    }
+    if (source != sources.end() && *source == slot) {
+      ++source;
+    } else {
+      window.push_back(permutation_[slot]);
+    }
+  }
+  for (; move != moves.end(); ++move) {
+    window.push_back(move->index);
+  }
+  std::copy(window.begin(), window.end(), permutation_.begin() + lo);
+
+  refit_ranges(root_, 0u, deltas);
+  reshape(root_, 0u);
+}
+
+void QuadTreeIndex::build()
+{
+  QuadTree::compute_bounds(points_, global_bounds_);
+
+  permutation_.resize(points_.size());
+  std::iota(permutation_.begin(), permutation_.end(), 0u);
+
+  root_ = new Node(detail::compute_quad_key(points_[0], 0u, global_bounds_));
+  build_tree(root_, 0u, static_cast<uint32_t>(permutation_.size()), 0u);
+}
+
+void QuadTreeIndex::build_tree(Node* node,
+  uint32_t begin,
+  uint32_t end,
+  uint8_t depth)
+{
+  node->begin_ = begin;
+  node->end_ = end;
+
+  if (end - begin <= MAX_BLOCK_SIZE || depth == detail::keys::max_depth()) {
+    return;
+  }
+
+  detail::Children_t children;
+  detail::keys::compute_children(node->quad_key_, children);
+
+  const uint64_t min_id = children[0];
+  std::size_t sizes[4];
+  detail::partition_by_child(
+    permutation_.begin() + begin,
+    permutation_.begin() + end,
+    [&](uint32_t index)
+    {
+      uint64_t c_pid = detail::compute_quad_key(points_[index], depth + 1,
+        global_bounds_);
+      std::size_t child = c_pid - min_id;
+      if (child >= 4) {
+        throw std::runtime_error("A quadkey got bucketed wrong.");
+      }
+      return child;
+    },
+    sizes);
+
+  uint32_t child_begin = begin;
+  for (std::size_t i = 0; i < 4; ++i) {
+    uint32_t child_end = child_begin + static_cast<uint32_t>(sizes[i]);
+    if (child_end != child_begin) {
+      node->children_[i] = new Node(children[i]);
+      build_tree(node->children_[i], child_begin, child_end, depth + 1);
+    }
+    child_begin = child_end;
+  }
+}
+
+void QuadTreeIndex::find_moves(Node* node,
+  uint8_t depth,
+  std::vector<uint32_t>& out_sources,
+  std::vector<Move>& out_moves,
+  SizeDeltas_t& out_deltas)
+{
+  if (!node->is_leaf()) {
+    for (Node* child : node->children_) {
+      if (child != nullptr) {
+        find_moves(child, depth + 1, out_sources, out_moves, out_deltas);
+      }
+    }
+    return;
+  }
+
+  for (uint32_t slot = node->begin_; slot < node->end_; ++slot) {
+    uint32_t index = permutation_[slot];
+    const detail::Point& p = points_[index];
+    if (detail::compute_quad_key(p, depth, global_bounds_) ==
+      node->quad_key_) {
+      continue;
+    }
+    --out_deltas[node];
+    out_sources.push_back(slot);
+    out_moves.push_back(find_target(index, out_deltas));
+  }
+}
+
+QuadTreeIndex::Move QuadTreeIndex::find_target(uint32_t index,
+  SizeDeltas_t& out_deltas)
+{
+  const detail::Point& point = points_[index];
+  Node* node = root_;
+  uint8_t depth = 0;
+  while (!node->is_leaf()) {
+    detail::Children_t children;
+    detail::keys::compute_children(node->quad_key_, children);
+    uint64_t c_pid = detail::compute_quad_key(point, depth + 1,
+      global_bounds_);
+    std::size_t i = c_pid - children[0];
+    if (i >= 4) {
+      throw std::runtime_error("A quadkey got bucketed wrong.");
+    }
+
+    if (node->children_[i] == nullptr) {
+      // The point's cell has no node yet. Give it an empty leaf at the
+      // slot its range would start at, after its earlier siblings.
+      uint32_t slot = node->begin_;
+      for (std::size_t j = 0; j < i; ++j) {
+        if (node->children_[j] != nullptr) {
+          slot = node->children_[j]->end_;
+        }
+      }
+      node->children_[i] = new Node(children[i]);
+      node->children_[i]->begin_ = slot;
+      node->children_[i]->end_ = slot;
+    }
+    node = node->children_[i];
+    ++depth;
+  }
+
+  ++out_deltas[node];
+  uint64_t leaf_order = node->quad_key_ <<
+    (2u * (detail::keys::max_depth() - depth));
+  return { index, node->end_, leaf_order };
+}
+
+uint32_t QuadTreeIndex::refit_ranges(Node* node,
+  uint32_t begin,
+  const SizeDeltas_t& deltas)
+{
+  uint32_t end = begin;
+  if (node->is_leaf()) {
+    int64_t size = static_cast<int64_t>(node->end_ - node->begin_);
+    auto delta = deltas.find(node);
+    if (delta != deltas.end()) {
+      size += delta->second;
+    }
+    end = begin + static_cast<uint32_t>(size);
+  } else {
+    for (Node*& child : node->children_) {
+      if (child == nullptr) {
+        continue;
+      }
+      uint32_t child_end = refit_ranges(child, end, deltas);
+      if (child_end == end) {
+        delete child;
+        child = nullptr;
+      }
+      end = child_end;
+    }
+  }
+
+  node->begin_ = begin;
+  node->end_ = end;
+  return end;
+}
+
+void QuadTreeIndex::reshape(Node* node, uint8_t depth)
+{
+  std::size_t size = node->end_ - node->begin_;
+  if (node->is_leaf()) {
+    if (size > MAX_BLOCK_SIZE && depth < detail::keys::max_depth()) {
+      build_tree(node, node->begin_, node->end_, depth);
+    }
+    return;
+  }
+
+  if (size <= MAX_BLOCK_SIZE) {
+    for (Node*& child : node->children_) {
+      delete child;
+      child = nullptr;
+    }
+    return;
+  }
+
+  for (Node* child : node->children_) {
+    if (child != nullptr) {
+      reshape(child, depth + 1);
+    }
+  }
+}
+
+int8_t QuadTreeIndex::max_depth_recursive(const Node* node) const
+{
+  if (node == nullptr) {
+    return -1;
+  } else {
+    auto depth0 = max_depth_recursive(node->children_[0]);
+    auto depth1 = max_depth_recursive(node->children_[1]);
+    auto depth2 = max_depth_recursive(node->children_[2]);
+    auto depth3 = max_depth_recursive(node->children_[3]);
+    return 1 + (std::max)({ depth0, depth1, depth2, depth3 });
+  }
+}
+
+void QuadTreeIndex::query_recursive(const Node* node,
+  const detail::Rect& cell,
+  const detail::Rect& rect,
+  std::vector<uint32_t>& out_indices) const
+{
+  float slack = detail::rect_slack(cell, rect);
+  detail::Rect outer = {
+    cell.lx - slack, cell.ly - slack, cell.hx + slack, cell.hy + slack
+  };
+  if (!detail::intersects(outer, rect)) {
+    return;
+  }
+
+  auto first = permutation_.begin() + node->begin_;
+  auto last = permutation_.begin() + node->end_;
+  if (rect.lx <= outer.lx && rect.ly <= outer.ly &&
+    rect.hx >= outer.hx && rect.hy >= outer.hy) {
+    out_indices.insert(out_indices.end(), first, last);
+    return;
+  }
+
+  if (node->is_leaf()) {
+    for (auto it = first; it != last; ++it) {
+      if (detail::contains(rect, points_[*it])) {
+        out_indices.push_back(*it);
+      }
+    }
+    return;
+  }
+
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (node->children_[i] != nullptr) {
+      query_recursive(node->children_[i], detail::child_rect(cell, i), rect,
+        out_indices);
+    }
+  }
+}
@@ -0,0 +1,109 @@
+#ifndef QUAD_TREE_INDEX_H
+#define QUAD_TREE_INDEX_H
+
+#include "QuadTree.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+// Non-owning counterpart of QuadTree. The tree is built over a caller owned
+// array of points, which must outlive it and must not move. Instead of
+// copying points into its leaves it keeps one permutation of 32-bit indices
+// into that array, and every leaf is a contiguous range of the permutation.
+class __declspec(dllexport) QuadTreeIndex
+{
+private:
+  struct __declspec(dllexport) Node
+  {
+    explicit Node(uint64_t quad_key);
+
+    ~Node();
+
+    bool is_leaf() const;
+
+    uint64_t quad_key_;
+    uint32_t begin_;
+    uint32_t end_;
+    Node* children_[4];
+  };
+
+public:
+  constexpr static std::size_t MAX_BLOCK_SIZE = QuadTree::MAX_BLOCK_SIZE;
+
+  explicit QuadTreeIndex(std::span<const detail::Point> points);
+
+  QuadTreeIndex(const QuadTreeIndex&) = delete;
+
+  QuadTreeIndex& operator=(const QuadTreeIndex&) = delete;
+
+  ~QuadTreeIndex();
+
+  std::span<const detail::Point> points() const;
+
+  const detail::Rect& global_bounds() const;
+
+  uint8_t max_depth() const;
+
+  // Appends the index into points() of every point inside rect, bounds
+  // inclusive, to out_indices.
+  void query(const detail::Rect& rect,
+    std::vector<uint32_t>& out_indices) const;
+
+  // Re-indexes the tree after its points have moved. points holds the new
+  // position of every point, by index, and replaces points(); it may be
+  // the same array updated in place. Points still in their leaf's cell are
+  // left where they are, and only the ones that crossed a cell boundary
+  // are moved to their new leaf, so the permutation is repaired rather
+  // than re-sorted. Leaves are then split or collapsed to the shape a
+  // fresh build would have. If a point has left global_bounds() the tree
+  // is rebuilt from scratch.
+  void update_positions(std::span<const detail::Point> points);
+
+private:
+  typedef std::unordered_map<const Node*, int64_t> SizeDeltas_t;
+
+  struct Move
+  {
+    uint32_t index;
+    uint32_t target;
+    // Morton order of the target leaf, which breaks ties between an empty
+    // new leaf and the leaf ending at the same slot.
+    uint64_t leaf_order;
+  };
+
+  void build();
+
+  void build_tree(Node* node, uint32_t begin, uint32_t end, uint8_t depth);
+
+  void find_moves(Node* node,
+    uint8_t depth,
+    std::vector<uint32_t>& out_sources,
+    std::vector<Move>& out_moves,
+    SizeDeltas_t& out_deltas);
+
+  Move find_target(uint32_t index, SizeDeltas_t& out_deltas);
+
+  uint32_t refit_ranges(Node* node,
+    uint32_t begin,
+    const SizeDeltas_t& deltas);
+
+  void reshape(Node* node, uint8_t depth);
+
+  int8_t max_depth_recursive(const Node* node) const;
+
+  void query_recursive(const Node* node,
+    const detail::Rect& cell,
+    const detail::Rect& rect,
+    std::vector<uint32_t>& out_indices) const;
+
+private:
+  std::span<const detail::Point> points_;
+  std::vector<uint32_t> permutation_;
+  Node* root_;
+  detail::Rect global_bounds_;
+};
+
+#endif
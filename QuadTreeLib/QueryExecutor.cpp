@@ -0,0 +1,228 @@
+#include "QueryExecutor.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+QueryDescriptor QueryDescriptor::within(const detail::Rect& rect)
+{
+  QueryDescriptor ret = {};
+  ret.kind = Kind::Rect;
+  ret.rect = rect;
+  return ret;
+}
+
+QueryDescriptor QueryDescriptor::within_radius(float x, float y, float radius)
+{
+  QueryDescriptor ret = {};
+  ret.kind = Kind::Radius;
+  ret.x = x;
+  ret.y = y;
+  ret.radius = radius;
+  return ret;
+}
+
+QueryDescriptor QueryDescriptor::nearest(float x, float y, std::size_t k)
+{
+  QueryDescriptor ret = {};
+  ret.kind = Kind::Nearest;
+  ret.x = x;
+  ret.y = y;
+  ret.k = k;
+  return ret;
+}
+
+QueryExecutor::Awaitable::Awaitable(QueryExecutor& executor,
+  const QueryDescriptor& descriptor) :
+  executor_(executor),
+  descriptor_(descriptor),
+  error_(),
+  result_()
+{}
+
+void QueryExecutor::Awaitable::await_suspend(std::coroutine_handle<> handle)
+{
+  executor_.submit(descriptor_,
+    [this, handle](std::exception_ptr error, Result_t result)
+    {
+      error_ = error;
+      result_ = std::move(result);
+      handle.resume();
+    });
+}
+
+QueryExecutor::Result_t QueryExecutor::Awaitable::await_resume()
+{
+  if (error_) {
+    std::rethrow_exception(error_);
+  }
+  return std::move(result_);
+}
+
+QueryExecutor::QueryExecutor(const QuadTree& tree, ThreadPool& pool) :
+  tree_(tree),
+  pool_(pool)
+{}
+
+std::future<QueryExecutor::Result_t> QueryExecutor::submit(
+  const QueryDescriptor& descriptor)
+{
+  auto promise = std::make_shared<std::promise<Result_t>>();
+  std::future<Result_t> future = promise->get_future();
+  submit(descriptor,
+    [promise](std::exception_ptr error, Result_t result)
+    {
+      if (error) {
+        promise->set_exception(error);
+      } else {
+        promise->set_value(std::move(result));
+      }
+    });
+  return future;
+}
+
+void QueryExecutor::submit(const QueryDescriptor& descriptor,
+  Callback_t callback)
+{
+  pool_.submit([this, descriptor, callback]()
+    {
+      run(descriptor, callback);
+    });
+}
+
+QueryExecutor::Awaitable QueryExecutor::async(
+  const QueryDescriptor& descriptor)
+{
+  return Awaitable(*this, descriptor);
+}
+
+void QueryExecutor::run(const QueryDescriptor& descriptor,
+  Callback_t callback)
+{
+  std::exception_ptr error;
+  Result_t result;
+  std::vector<Part> parts;
+  try {
+    if (descriptor.kind == QueryDescriptor::Kind::Nearest) {
+      tree_.nearest(descriptor.x, descriptor.y, descriptor.k, result);
+    } else if (tree_.root_ != nullptr &&
+      (descriptor.kind != QueryDescriptor::Kind::Radius ||
+        descriptor.radius >= 0.0f)) {
+      split(descriptor, tree_.root_, tree_.global_bounds_, 0u, parts);
+
+      uint64_t count = 0;
+      for (const Part& part : parts) {
+        count += part.node->summary_.count;
+      }
+      if (parts.size() < 2 || count <= SPLIT_POINT_COUNT) {
+        for (const Part& part : parts) {
+          run_part(descriptor, part, result);
+        }
+        parts.clear();
+      }
+    }
+  } catch (...) {
+    error = std::current_exception();
+    parts.clear();
+  }
+
+  if (parts.empty()) {
+    callback(error, std::move(result));
+    return;
+  }
+
+  // Fan the subtrees out to the pool; the last part to finish stitches the
+  // results together in subtree order and completes the query.
+  struct Join
+  {
+    std::vector<Result_t> results;
+    std::atomic<std::size_t> remaining;
+    std::mutex mutex;
+    std::exception_ptr error;
+  };
+  auto join = std::make_shared<Join>();
+  join->results.resize(parts.size());
+  join->remaining = parts.size();
+
+  for (std::size_t i = 0; i < parts.size(); ++i) {
+    const Part part = parts[i];
+    pool_.submit([descriptor, callback, join, part, i]()
+      {
+        try {
+          run_part(descriptor, part, join->results[i]);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(join->mutex);
+          if (!join->error) {
+            join->error = std::current_exception();
+          }
+        }
+        if (--join->remaining != 0) {
+          return;
+        }
+
+        Result_t result;
+        if (!join->error) {
+          std::size_t total = 0;
+          for (const Result_t& part_result : join->results) {
+            total += part_result.size();
+          }
+          result.reserve(total);
+          for (const Result_t& part_result : join->results) {
+            result.insert(result.end(), part_result.begin(),
+              part_result.end());
+          }
+        }
+        callback(join->error, std::move(result));
+      });
+  }
+}
+
+void QueryExecutor::split(const QueryDescriptor& descriptor,
+  const QuadTree::Node* node,
+  const detail::Rect& cell,
+  uint8_t depth,
+  std::vector<Part>& out_parts) const
+{
+  if (!overlaps(descriptor, cell)) {
+    return;
+  }
+  if (depth == SPLIT_DEPTH || node->is_leaf()) {
+    out_parts.push_back({ node, cell });
+    return;
+  }
+  for (std::size_t i = 0; i < 4; ++i) {
+    if (node->children_[i] != nullptr) {
+      split(descriptor, node->children_[i],
+        QuadTree::child_cell(node, cell, i), depth + 1, out_parts);
+    }
+  }
+}
+
+bool QueryExecutor::overlaps(const QueryDescriptor& descriptor,
+  const detail::Rect& cell)
+{
+  float slack = detail::rect_slack(cell, cell);
+  detail::Rect outer = {
+    cell.lx - slack, cell.ly - slack, cell.hx + slack, cell.hy + slack
+  };
+  if (descriptor.kind == QueryDescriptor::Kind::Rect) {
+    return detail::intersects(outer, descriptor.rect);
+  }
+  return detail::min_distance_sq(outer, descriptor.x, descriptor.y) <=
+    descriptor.radius * descriptor.radius;
+}
+
+void QueryExecutor::run_part(const QueryDescriptor& descriptor,
+  const Part& part,
+  Result_t& out_points)
+{
+  if (descriptor.kind == QueryDescriptor::Kind::Rect) {
+    NullQueryTracer tracer;
+    QuadTree::query_recursive(part.node, part.cell, descriptor.rect,
+      out_points, tracer);
+  } else {
+    QuadTree::query_radius_recursive(part.node, part.cell, descriptor.x,
+      descriptor.y, descriptor.radius, out_points);
+  }
+}
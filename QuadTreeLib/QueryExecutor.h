@@ -0,0 +1,112 @@
+#ifndef QUERY_EXECUTOR_H
+#define QUERY_EXECUTOR_H
+
+#include "QuadTree.h"
+#include "ThreadPool.h"
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <vector>
+
+// One query to run on a QueryExecutor.
+struct __declspec(dllexport) QueryDescriptor
+{
+  enum class Kind {
+    Rect = 0,
+    Radius = 1,
+    Nearest = 2
+  };
+
+  static QueryDescriptor within(const detail::Rect& rect);
+
+  static QueryDescriptor within_radius(float x, float y, float radius);
+
+  static QueryDescriptor nearest(float x, float y, std::size_t k);
+
+  Kind kind;
+  detail::Rect rect;
+  float x;
+  float y;
+  float radius;
+  std::size_t k;
+};
+
+// Runs QuadTree queries on a shared ThreadPool so the calling thread never
+// blocks. Rect and radius queries over more than SPLIT_POINT_COUNT points
+// are split into one subtask per subtree at SPLIT_DEPTH, run in parallel
+// and concatenated. The tree must outlive the executor and must not be
+// modified while queries are in flight.
+class __declspec(dllexport) QueryExecutor
+{
+public:
+  typedef std::vector<detail::Point> Result_t;
+
+  typedef std::function<void(std::exception_ptr, Result_t)> Callback_t;
+
+  constexpr static std::size_t SPLIT_POINT_COUNT =
+    64ull * QuadTree::MAX_BLOCK_SIZE;
+
+  constexpr static uint8_t SPLIT_DEPTH = 3u;
+
+  // Awaiting it runs the query on the pool and resumes the coroutine on
+  // the pool thread that completed it.
+  class Awaitable
+  {
+  public:
+    Awaitable(QueryExecutor& executor, const QueryDescriptor& descriptor);
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle);
+
+    Result_t await_resume();
+
+  private:
+    QueryExecutor& executor_;
+    QueryDescriptor descriptor_;
+    std::exception_ptr error_;
+    Result_t result_;
+  };
+
+  QueryExecutor(const QuadTree& tree, ThreadPool& pool);
+
+  std::future<Result_t> submit(const QueryDescriptor& descriptor);
+
+  // Calls callback on a pool thread with the results, or with the
+  // exception the query threw. The callback runs as a ThreadPool task and
+  // must not throw.
+  void submit(const QueryDescriptor& descriptor, Callback_t callback);
+
+  Awaitable async(const QueryDescriptor& descriptor);
+
+private:
+  struct Part
+  {
+    const QuadTree::Node* node;
+    detail::Rect cell;
+  };
+
+  void run(const QueryDescriptor& descriptor, Callback_t callback);
+
+  void split(const QueryDescriptor& descriptor,
+    const QuadTree::Node* node,
+    const detail::Rect& cell,
+    uint8_t depth,
+    std::vector<Part>& out_parts) const;
+
+  static bool overlaps(const QueryDescriptor& descriptor,
+    const detail::Rect& cell);
+
+  static void run_part(const QueryDescriptor& descriptor,
+    const Part& part,
+    Result_t& out_points);
+
+private:
+  const QuadTree& tree_;
+  ThreadPool& pool_;
+};
+
+#endif
@@ -0,0 +1,48 @@
+#include "QueryTrace.h"
+
+QueryTraceSink::QueryTraceSink() :
+  query_count_(0),
+  nodes_visited_(0),
+  leaves_scanned_(0),
+  points_tested_(0),
+  points_emitted_(0),
+  subtrees_accepted_(0),
+  elapsed_ns_(0)
+{}
+
+void QueryTraceSink::record(const QueryTrace& trace)
+{
+  const auto order = std::memory_order_relaxed;
+  query_count_.fetch_add(1, order);
+  nodes_visited_.fetch_add(trace.nodes_visited, order);
+  leaves_scanned_.fetch_add(trace.leaves_scanned, order);
+  points_tested_.fetch_add(trace.points_tested, order);
+  points_emitted_.fetch_add(trace.points_emitted, order);
+  subtrees_accepted_.fetch_add(trace.subtrees_accepted, order);
+  elapsed_ns_.fetch_add(trace.elapsed.count(), order);
+}
+
+void QueryTraceSink::sample(QueryTrace& out_totals,
+  uint64_t& out_query_count) const
+{
+  const auto order = std::memory_order_relaxed;
+  out_query_count = query_count_.load(order);
+  out_totals.nodes_visited = nodes_visited_.load(order);
+  out_totals.leaves_scanned = leaves_scanned_.load(order);
+  out_totals.points_tested = points_tested_.load(order);
+  out_totals.points_emitted = points_emitted_.load(order);
+  out_totals.subtrees_accepted = subtrees_accepted_.load(order);
+  out_totals.elapsed = std::chrono::nanoseconds(elapsed_ns_.load(order));
+}
+
+void QueryTraceSink::reset()
+{
+  const auto order = std::memory_order_relaxed;
+  query_count_.store(0, order);
+  nodes_visited_.store(0, order);
+  leaves_scanned_.store(0, order);
+  points_tested_.store(0, order);
+  points_emitted_.store(0, order);
+  subtrees_accepted_.store(0, order);
+  elapsed_ns_.store(0, order);
+}
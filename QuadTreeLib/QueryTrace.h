@@ -0,0 +1,105 @@
+#ifndef QUERY_TRACE_H
+#define QUERY_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Work done by a single query.
+struct __declspec(dllexport) QueryTrace
+{
+  uint64_t nodes_visited;
+  uint64_t leaves_scanned;
+  uint64_t points_tested;
+  uint64_t points_emitted;
+  uint64_t subtrees_accepted;
+  std::chrono::nanoseconds elapsed;
+};
+
+// Accumulates QueryTraces from any number of querying threads. All of the
+// counters are relaxed atomics so a monitoring thread can sample them at
+// any time without stalling the queries.
+class __declspec(dllexport) QueryTraceSink
+{
+public:
+  QueryTraceSink();
+
+  QueryTraceSink(const QueryTraceSink&) = delete;
+
+  QueryTraceSink& operator=(const QueryTraceSink&) = delete;
+
+  void record(const QueryTrace& trace);
+
+  // The counters are read one at a time, so a sample taken while queries
+  // are recording may mix totals from either side of a record() call.
+  void sample(QueryTrace& out_totals, uint64_t& out_query_count) const;
+
+  void reset();
+
+private:
+  std::atomic<uint64_t> query_count_;
+  std::atomic<uint64_t> nodes_visited_;
+  std::atomic<uint64_t> leaves_scanned_;
+  std::atomic<uint64_t> points_tested_;
+  std::atomic<uint64_t> points_emitted_;
+  std::atomic<uint64_t> subtrees_accepted_;
+  std::atomic<int64_t> elapsed_ns_;
+};
+
+// Default tracing policy for QuadTree queries. Every hook is empty, so a
+// query instantiated with it compiles down to the untraced traversal.
+struct NullQueryTracer
+{
+  void begin() {}
+  void visit_node() {}
+  void scan_leaf() {}
+  void test_points(std::size_t) {}
+  void emit_points(std::size_t) {}
+  void accept_subtree() {}
+  void end() {}
+};
+
+// Tracing policy that counts the work done by one query at a time and,
+// when given a sink, publishes each finished trace to it.
+struct QueryTracer
+{
+  explicit QueryTracer(QueryTraceSink* sink = nullptr) :
+    trace(),
+    sink_(sink),
+    start_()
+  {}
+
+  void begin()
+  {
+    trace = {};
+    start_ = std::chrono::steady_clock::now();
+  }
+
+  void visit_node() { ++trace.nodes_visited; }
+
+  void scan_leaf() { ++trace.leaves_scanned; }
+
+  void test_points(std::size_t count) { trace.points_tested += count; }
+
+  void emit_points(std::size_t count) { trace.points_emitted += count; }
+
+  void accept_subtree() { ++trace.subtrees_accepted; }
+
+  void end()
+  {
+    trace.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start_);
+    if (sink_ != nullptr) {
+      sink_->record(trace);
+    }
+  }
+
+  QueryTrace trace;
+
+private:
+  QueryTraceSink* sink_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#endif
@@ -0,0 +1,177 @@
+#include "ShardedQuadTree.h"
+
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+namespace detail
+{
+  // Restricts the calling thread to the processors of one NUMA node. Does
+  // nothing where NUMA placement is not supported.
+  void bind_to_numa_node(uint32_t node)
+  {
+#ifdef _WIN32
+    GROUP_AFFINITY affinity = {};
+    if (GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity) &&
+      affinity.Mask != 0) {
+      SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+    }
+#else
+    (void)node;
+#endif
+  }
+}
+
+ShardedQuadTree::ShardedQuadTree(
+  std::vector<detail::Point*>::iterator begin,
+  std::vector<detail::Point*>::iterator end,
+  uint8_t shard_depth,
+  std::size_t thread_count) :
+  shard_depth_(shard_depth),
+  global_bounds_({}),
+  shards_(),
+  shard_numa_nodes_()
+{
+  if (shard_depth > MAX_SHARD_DEPTH) {
+    throw std::runtime_error("Shard depth " + std::to_string(shard_depth) +
+      " is deeper than " + std::to_string(MAX_SHARD_DEPTH) + ".");
+  }
+
+  const std::size_t count = static_cast<std::size_t>(1) << (2 * shard_depth);
+  shards_.resize(count);
+  shard_numa_nodes_.resize(count, 0);
+  if (begin == end) {
+    return;
+  }
+
+  QuadTree::compute_bounds(begin, end, global_bounds_);
+
+  const uint64_t min_id = detail::keys::min_id(shard_depth_);
+  std::vector<std::vector<detail::Point*>> buckets(count);
+  for (auto it = begin; it != end; ++it) {
+    uint64_t key = detail::compute_quad_key(**it, shard_depth_,
+      global_bounds_);
+    buckets[key - min_id].push_back(*it);
+  }
+
+  if (thread_count == 0) {
+    thread_count = (std::max)(1u, std::thread::hardware_concurrency());
+  }
+  thread_count = (std::min)(thread_count, count);
+  const uint32_t numa_nodes = numa_node_count();
+
+  std::vector<std::thread> builders;
+  std::vector<std::exception_ptr> errors(thread_count);
+  for (std::size_t t = 0; t < thread_count; ++t) {
+    builders.emplace_back([&, t]()
+      {
+        uint32_t node = static_cast<uint32_t>(t % numa_nodes);
+        detail::bind_to_numa_node(node);
+        try {
+          for (std::size_t s = t; s < count; s += thread_count) {
+            shard_numa_nodes_[s] = node;
+            if (!buckets[s].empty()) {
+              shards_[s] = std::make_unique<QuadTree>(buckets[s].begin(),
+                buckets[s].end(), QuadTree::BuildMode::InPlace);
+            }
+            std::vector<detail::Point*>().swap(buckets[s]);
+          }
+        } catch (...) {
+          errors[t] = std::current_exception();
+        }
+      });
+  }
+  for (std::thread& builder : builders) {
+    builder.join();
+  }
+  for (const std::exception_ptr& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+ShardedQuadTree::~ShardedQuadTree()
+{}
+
+const detail::Rect& ShardedQuadTree::global_bounds() const
+{
+  return global_bounds_;
+}
+
+uint8_t ShardedQuadTree::shard_depth() const
+{
+  return shard_depth_;
+}
+
+std::size_t ShardedQuadTree::shard_count() const
+{
+  return shards_.size();
+}
+
+uint64_t ShardedQuadTree::shard_key(std::size_t index) const
+{
+  return detail::keys::min_id(shard_depth_) + index;
+}
+
+const QuadTree* ShardedQuadTree::shard(std::size_t index) const
+{
+  return shards_[index].get();
+}
+
+uint32_t ShardedQuadTree::shard_numa_node(std::size_t index) const
+{
+  return shard_numa_nodes_[index];
+}
+
+uint32_t ShardedQuadTree::numa_node_count()
+{
+#ifdef _WIN32
+  ULONG highest = 0;
+  if (GetNumaHighestNodeNumber(&highest)) {
+    return static_cast<uint32_t>(highest) + 1u;
+  }
+#endif
+  return 1u;
+}
+
+void ShardedQuadTree::route(const detail::Rect& rect,
+  std::vector<std::size_t>& out_shards) const
+{
+  for (std::size_t i = 0; i < shards_.size(); ++i) {
+    if (shards_[i] != nullptr &&
+      detail::intersects(shards_[i]->global_bounds(), rect)) {
+      out_shards.push_back(i);
+    }
+  }
+}
+
+void ShardedQuadTree::query(const detail::Rect& rect,
+  std::vector<detail::Point>& out_points) const
+{
+  std::vector<std::size_t> shards;
+  route(rect, shards);
+  for (std::size_t i : shards) {
+    shards_[i]->query(rect, out_points);
+  }
+}
+
+void ShardedQuadTree::query_radius(float x,
+  float y,
+  float radius,
+  std::vector<detail::Point>& out_points) const
+{
+  detail::Rect rect = { x - radius, y - radius, x + radius, y + radius };
+  std::vector<std::size_t> shards;
+  route(rect, shards);
+  for (std::size_t i : shards) {
+    shards_[i]->query_radius(x, y, radius, out_points);
+  }
+}
@@ -0,0 +1,76 @@
+#ifndef SHARDED_QUAD_TREE_H
+#define SHARDED_QUAD_TREE_H
+
+#include "QuadTree.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// QuadTree split at a fixed depth into 4^depth independent shards, one per
+// quad key at that depth, so that no two threads share upper nodes. Each
+// shard is built by its own builder thread, pinned to a NUMA node where the
+// platform supports it, so the shard's memory is first touched, and
+// therefore allocated, on that node. Queries visit only the shards whose
+// points' bounds overlap them.
+class __declspec(dllexport) ShardedQuadTree
+{
+public:
+  constexpr static uint8_t MAX_SHARD_DEPTH = 6u;
+
+  // A thread_count of 0 uses std::thread::hardware_concurrency(). Builder
+  // thread t is bound to NUMA node t % numa_node_count() and builds every
+  // shard s with s % thread_count == t.
+  ShardedQuadTree(
+    std::vector<detail::Point *>::iterator begin,
+    std::vector<detail::Point *>::iterator end,
+    uint8_t shard_depth,
+    std::size_t thread_count = 0);
+
+  ShardedQuadTree(const ShardedQuadTree&) = delete;
+
+  ShardedQuadTree& operator=(const ShardedQuadTree&) = delete;
+
+  ~ShardedQuadTree();
+
+  const detail::Rect& global_bounds() const;
+
+  uint8_t shard_depth() const;
+
+  std::size_t shard_count() const;
+
+  // Quad key of shard index, between detail::min_id(shard_depth()) and
+  // detail::max_id(shard_depth()).
+  uint64_t shard_key(std::size_t index) const;
+
+  // The shard's tree, or nullptr when no point fell in its cell.
+  const QuadTree* shard(std::size_t index) const;
+
+  // NUMA node the shard was built on.
+  uint32_t shard_numa_node(std::size_t index) const;
+
+  static uint32_t numa_node_count();
+
+  // Appends the index of every shard whose points' bounds overlap rect.
+  void route(const detail::Rect& rect,
+    std::vector<std::size_t>& out_shards) const;
+
+  // Appends every point inside rect, bounds inclusive, to out_points.
+  void query(const detail::Rect& rect,
+    std::vector<detail::Point>& out_points) const;
+
+  // Appends every point within radius of (x, y), boundary inclusive.
+  void query_radius(float x,
+    float y,
+    float radius,
+    std::vector<detail::Point>& out_points) const;
+
+private:
+  uint8_t shard_depth_;
+  detail::Rect global_bounds_;
+  std::vector<std::unique_ptr<QuadTree>> shards_;
+  std::vector<uint32_t> shard_numa_nodes_;
+};
+
+#endif
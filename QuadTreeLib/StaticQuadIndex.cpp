@@ -0,0 +1,152 @@
+#include "StaticQuadIndex.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+StaticQuadIndex::StaticQuadIndex(std::span<const detail::Point> points) :
+  global_bounds_({}),
+  points_(),
+  keys_(),
+  directory_(),
+  directory_samples_()
+{
+  if (points.empty()) {
+    return;
+  }
+  if (points.size() > (std::numeric_limits<uint32_t>::max)()) {
+    throw std::runtime_error(
+      "StaticQuadIndex holds at most 2^32 - 1 points.");
+  }
+
+  QuadTree::compute_bounds(points, global_bounds_);
+
+  const uint8_t depth = detail::keys::max_depth();
+  std::vector<std::pair<uint64_t, uint32_t>> order(points.size());
+  for (std::size_t i = 0; i < points.size(); ++i) {
+    order[i] = {
+      detail::compute_quad_key(points[i], depth, global_bounds_),
+      static_cast<uint32_t>(i)
+    };
+  }
+  std::sort(order.begin(), order.end());
+
+  points_.reserve(points.size());
+  keys_.reserve(points.size());
+  for (const auto& entry : order) {
+    keys_.push_back(entry.first);
+    points_.push_back(points[entry.second]);
+  }
+
+  const std::size_t samples = (keys_.size() + SAMPLE_STRIDE - 1) /
+    SAMPLE_STRIDE;
+  directory_.resize(samples + 1);
+  directory_samples_.resize(samples + 1);
+  std::size_t next_sample = 0;
+  build_directory(next_sample, 1);
+}
+
+std::span<const detail::Point> StaticQuadIndex::points() const
+{
+  return points_;
+}
+
+const detail::Rect& StaticQuadIndex::global_bounds() const
+{
+  return global_bounds_;
+}
+
+std::size_t StaticQuadIndex::lower_bound(uint64_t quad_key) const
+{
+  // First sample not less than quad_key. Each step picks a child without a
+  // branch, and the trailing ones of slot count the final right turns to
+  // undo.
+  const std::size_t samples = directory_.size() - 1;
+  std::size_t slot = 1;
+  while (slot <= samples) {
+    slot = 2 * slot + (directory_[slot] < quad_key);
+  }
+  slot >>= std::countr_one(slot) + 1;
+  const std::size_t sample = slot == 0 ? samples : directory_samples_[slot];
+
+  // The sample before it is less than quad_key, so the answer is in the
+  // stride between the two.
+  const std::size_t begin = sample == 0 ? 0 :
+    (sample - 1) * SAMPLE_STRIDE + 1;
+  const std::size_t end = sample == samples ? keys_.size() :
+    sample * SAMPLE_STRIDE;
+  if (begin == end) {
+    return begin;
+  }
+
+  const uint64_t* base = keys_.data() + begin;
+  std::size_t length = end - begin;
+  while (length > 1) {
+    std::size_t half = length / 2;
+    base += (base[half] < quad_key) ? half : 0;
+    length -= half;
+  }
+  return static_cast<std::size_t>(base - keys_.data()) +
+    (*base < quad_key);
+}
+
+void StaticQuadIndex::query(const detail::Rect& rect,
+  std::vector<detail::Point>& out_points) const
+{
+  if (points_.empty() || !detail::intersects(global_bounds_, rect)) {
+    return;
+  }
+
+  // Split at a depth where a cell is a quarter to an eighth of the rect's
+  // larger side, so ranges cover little more than the rect.
+  const float share = (std::max)(
+    ((std::min)(rect.hx, global_bounds_.hx) -
+      (std::max)(rect.lx, global_bounds_.lx)) /
+      (global_bounds_.hx - global_bounds_.lx),
+    ((std::min)(rect.hy, global_bounds_.hy) -
+      (std::max)(rect.ly, global_bounds_.ly)) /
+      (global_bounds_.hy - global_bounds_.ly));
+  const float levels = share > 0.0f ? std::floor(-std::log2(share)) : 31.0f;
+  const uint8_t depth = static_cast<uint8_t>((std::min)(
+    levels + 2.0f, static_cast<float>(detail::keys::max_depth())));
+
+  std::vector<detail::KeyRange> ranges;
+  detail::compute_key_ranges(rect, global_bounds_, depth, MAX_QUERY_RANGES,
+    ranges);
+
+  const uint32_t shift = 2u * (detail::keys::max_depth() - depth);
+  for (const detail::KeyRange& range : ranges) {
+    const uint64_t lo = range.lo << shift;
+    const uint64_t hi = ((range.hi + 1) << shift) - 1;
+    for (std::size_t i = lower_bound(lo); i < keys_.size() && keys_[i] <= hi;
+      ++i) {
+      if (detail::contains(rect, points_[i])) {
+        out_points.push_back(points_[i]);
+      }
+    }
+  }
+}
+
+std::size_t StaticQuadIndex::memory_bytes() const
+{
+  return points_.capacity() * sizeof(detail::Point) +
+    keys_.capacity() * sizeof(uint64_t) +
+    directory_.capacity() * sizeof(uint64_t) +
+    directory_samples_.capacity() * sizeof(uint32_t);
+}
+
+void StaticQuadIndex::build_directory(std::size_t& next_sample,
+  std::size_t slot)
+{
+  if (slot >= directory_.size()) {
+    return;
+  }
+  build_directory(next_sample, 2 * slot);
+  directory_[slot] = keys_[next_sample * SAMPLE_STRIDE];
+  directory_samples_[slot] = static_cast<uint32_t>(next_sample);
+  ++next_sample;
+  build_directory(next_sample, 2 * slot + 1);
+}
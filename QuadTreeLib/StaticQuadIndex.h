@@ -0,0 +1,57 @@
+#ifndef STATIC_QUAD_INDEX_H
+#define STATIC_QUAD_INDEX_H
+
+#include "QuadTree.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Read-only alternative to QuadTree with no nodes at all. Points are copied
+// into one array sorted by their quad key at detail::max_depth(), so every
+// cell of the tree at any depth is a contiguous run of the array. A query
+// splits its rect into key ranges with detail::compute_key_ranges and scans
+// each run, found by binary search. One key in every SAMPLE_STRIDE is kept
+// in a small directory in Eytzinger order, which is searched first so the
+// search over the full key array touches a single stride of it.
+class __declspec(dllexport) StaticQuadIndex
+{
+public:
+  constexpr static std::size_t SAMPLE_STRIDE = 64ull;
+
+  // Upper bound on the key ranges a query is split into.
+  constexpr static std::size_t MAX_QUERY_RANGES = 32ull;
+
+  explicit StaticQuadIndex(std::span<const detail::Point> points);
+
+  // Points sorted by key.
+  std::span<const detail::Point> points() const;
+
+  const detail::Rect& global_bounds() const;
+
+  // Index of the first point whose key is not less than quad_key, a key at
+  // detail::max_depth(), or points().size() when there is none.
+  std::size_t lower_bound(uint64_t quad_key) const;
+
+  // Appends every point inside rect, bounds inclusive, to out_points.
+  void query(const detail::Rect& rect,
+    std::vector<detail::Point>& out_points) const;
+
+  // Bytes held by the points, keys and directory.
+  std::size_t memory_bytes() const;
+
+private:
+  void build_directory(std::size_t& next_sample, std::size_t slot);
+
+private:
+  detail::Rect global_bounds_;
+  std::vector<detail::Point> points_;
+  std::vector<uint64_t> keys_;
+  // Every SAMPLE_STRIDE-th key in Eytzinger order, from slot 1, and the
+  // sample number each slot holds.
+  std::vector<uint64_t> directory_;
+  std::vector<uint32_t> directory_samples_;
+};
+
+#endif
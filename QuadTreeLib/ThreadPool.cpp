@@ -0,0 +1,118 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+namespace detail
+{
+  // Pool and worker index of the calling thread, when it is a pool worker.
+  thread_local const ThreadPool* current_pool_ = nullptr;
+  thread_local std::size_t current_worker_ = 0;
+}
+
+ThreadPool::ThreadPool(std::size_t thread_count) :
+  workers_(),
+  threads_(),
+  pending_(0),
+  next_worker_(0),
+  sleep_mutex_(),
+  wake_(),
+  stopping_(false)
+{
+  if (thread_count == 0) {
+    thread_count = (std::max)(1u, std::thread::hardware_concurrency());
+  }
+
+  for (std::size_t i = 0; i < thread_count; ++i) {
+    workers_.push_back(std::make_unique<Worker>());
+  }
+  threads_.reserve(thread_count);
+  for (std::size_t i = 0; i < thread_count; ++i) {
+    threads_.emplace_back(&ThreadPool::run, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+std::size_t ThreadPool::thread_count() const
+{
+  return threads_.size();
+}
+
+void ThreadPool::submit(Task_t task)
+{
+  std::size_t index = 0;
+  if (detail::current_pool_ == this) {
+    index = detail::current_worker_;
+  } else {
+    index = next_worker_++ % workers_.size();
+  }
+
+  // Counted before it is published, so a worker that takes it at once
+  // never drives pending_ below zero.
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    ++pending_;
+  }
+  {
+    std::lock_guard<std::mutex> lock(workers_[index]->mutex);
+    workers_[index]->tasks.push_back(std::move(task));
+  }
+  wake_.notify_one();
+}
+
+void ThreadPool::run(std::size_t index)
+{
+  detail::current_pool_ = this;
+  detail::current_worker_ = index;
+
+  Task_t task;
+  while (true) {
+    if (pop_or_steal(index, task)) {
+      task();
+      task = nullptr;
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    wake_.wait(lock, [&]() { return stopping_ || pending_ > 0; });
+    if (stopping_ && pending_ == 0) {
+      return;
+    }
+  }
+}
+
+bool ThreadPool::pop_or_steal(std::size_t index, Task_t& out_task)
+{
+  {
+    Worker& own = *workers_[index];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.tasks.empty()) {
+      out_task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      --pending_;
+      return true;
+    }
+  }
+
+  for (std::size_t offset = 1; offset < workers_.size(); ++offset) {
+    Worker& victim = *workers_[(index + offset) % workers_.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      out_task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      --pending_;
+      return true;
+    }
+  }
+  return false;
+}
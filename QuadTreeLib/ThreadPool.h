@@ -0,0 +1,61 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed size work-stealing thread pool. Every worker owns a deque: tasks it
+// submits itself are pushed to and popped from the back of its own deque,
+// tasks from other threads are spread round robin, and an idle worker
+// steals from the front of the others' deques.
+class __declspec(dllexport) ThreadPool
+{
+public:
+  typedef std::function<void()> Task_t;
+
+  // A thread_count of 0 uses std::thread::hardware_concurrency().
+  explicit ThreadPool(std::size_t thread_count = 0);
+
+  ThreadPool(const ThreadPool&) = delete;
+
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Runs every task already submitted, then joins the workers.
+  ~ThreadPool();
+
+  std::size_t thread_count() const;
+
+  // Queues task to run on a worker. Tasks must not throw: the pool has no
+  // caller to report to, so an exception escaping a task terminates the
+  // process, as it would on any other std::thread.
+  void submit(Task_t task);
+
+private:
+  struct Worker
+  {
+    std::mutex mutex;
+    std::deque<Task_t> tasks;
+  };
+
+  void run(std::size_t index);
+
+  bool pop_or_steal(std::size_t index, Task_t& out_task);
+
+private:
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  std::atomic<std::size_t> pending_;
+  std::atomic<std::size_t> next_worker_;
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  bool stopping_;
+};
+
+#endif
@@ -2,16 +2,41 @@
 #include "CppUnitTest.h"
 
 #include <algorithm>
+#include <atomic>
+#include <coroutine>
 #include <ctime>
 #include <cstdlib>
+#include <future>
+#include <sstream>
+#include <thread>
 
+#include <ChangeLog.h>
+#include <LooseQuadTree.h>
+#include <PersistentQuadTree.h>
 #include <QuadTree.h>
+#include <QuadTreeIndex.h>
+#include <QueryExecutor.h>
+#include <ShardedQuadTree.h>
+#include <StaticQuadIndex.h>
 
 // For test macros
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
 namespace QuadTreeNS
 {
+  // Minimal eagerly started coroutine for exercising awaitables.
+  struct FireAndForget
+  {
+    struct promise_type
+    {
+      FireAndForget get_return_object() { return {}; }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { std::terminate(); }
+    };
+  };
+
   TEST_CLASS(TestQuadTree)
   {
   private:
@@ -116,6 +141,36 @@ namespace QuadTreeNS
       release_resources(points);
     }
 
+    TEST_METHOD(TestRectGenerateFromContiguousPoints)
+    {
+      srand(7);
+      for (std::size_t count : { 1, 2, 3, 5, 1001, 600001 }) {
+        std::vector<detail::Point> points(count);
+        std::vector<detail::Point *> point_ptrs(count);
+        for (std::size_t i = 0; i < count; ++i) {
+          points[i] = {
+            static_cast<int8_t>(i), static_cast<int32_t>(i),
+            frand(-1000.0f, +1000.0f), frand(-50.0f, +70.0f)
+          };
+          point_ptrs[i] = &points[i];
+        }
+
+        detail::Rect expected;
+        QuadTree::compute_bounds(point_ptrs.begin(), point_ptrs.end(),
+          expected);
+        detail::Rect actual;
+        QuadTree::compute_bounds(points, actual);
+        Assert::AreEqual(expected.lx, actual.lx);
+        Assert::AreEqual(expected.ly, actual.ly);
+        Assert::AreEqual(expected.hx, actual.hx);
+        Assert::AreEqual(expected.hy, actual.hy);
+
+        for (const detail::Point& p : points) {
+          Assert::IsTrue(detail::contains(actual, p));
+        }
+      }
+    }
+
     TEST_METHOD(TestInsertMaxBlockSizePointsDistributedEvenly)
     {
       std::size_t point_count = 16 * QuadTree::MAX_BLOCK_SIZE;
@@ -824,5 +879,1587 @@ namespace QuadTreeNS
         }
       }
     }
+
+    TEST_METHOD(TestInsertGrowsRoot)
+    {
+      auto points = acquire_random_point_distributed_equally();
+      QuadTree quad_tree(points.begin(), points.end());
+
+      std::vector<detail::Point> inserted = {
+        { 1, 1, +40.0f, +3.0f },
+        { 2, 2, -100.0f, -250.0f },
+        { 3, 3, +5.0f, +900.0f },
+      };
+      // Enough points in one existing leaf to force it to split after the
+      // root has grown around it.
+      for (std::size_t i = 0; i < 2 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        inserted.push_back({
+          static_cast<int8_t>(i), static_cast<int32_t>(i),
+          frand(-15.0f, -14.0f), frand(+14.0f, +15.0f)
+        });
+      }
+      for (const detail::Point& p : inserted) {
+        quad_tree.insert(p);
+      }
+
+      const detail::Rect& bounds = quad_tree.global_bounds();
+      for (const detail::Point& p : inserted) {
+        Assert::IsTrue(detail::contains(bounds, p));
+      }
+
+      std::vector<detail::Point> all;
+      quad_tree.query(bounds, all);
+      Assert::AreEqual(points.size() + inserted.size(), all.size());
+
+      const detail::Rect rect = { -16.0f, +13.5f, -13.0f, +16.0f };
+      std::size_t expected = 0;
+      for (const detail::Point* p : points) {
+        expected += detail::contains(rect, *p) ? 1 : 0;
+      }
+      for (const detail::Point& p : inserted) {
+        expected += detail::contains(rect, p) ? 1 : 0;
+      }
+      std::vector<detail::Point> found;
+      quad_tree.query(rect, found);
+      Assert::AreEqual(expected, found.size());
+
+      QuadTree::Stats stats;
+      quad_tree.compute_stats(stats);
+      Assert::AreEqual(all.size(), stats.point_count);
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestAlternatingGrowthKeepsPointsReachable)
+    {
+      // Each far point grows the root in the opposite direction to the
+      // last, so the original root ends up several levels down inside
+      // cells that no longer halve evenly back to its bounds.
+      const std::vector<detail::Point> far = {
+        { 20001, 0, +29.2f, -12.4f },
+        { 20002, 0, -36.4f, +22.8f },
+        { 20003, 0, +116.8f, -49.6f },
+        { 20004, 0, -145.6f, +91.2f },
+        { 20005, 0, +467.2f, -198.4f },
+        { 20006, 0, -582.4f, +364.8f },
+      };
+      for (unsigned seed = 1; seed <= 20; ++seed) {
+        srand(seed);
+        std::vector<detail::Point> storage;
+        for (int32_t i = 0; i < 20000; ++i) {
+          storage.push_back({ i, i, frand(-10.0f, 10.0f),
+            frand(-10.0f, 10.0f) });
+        }
+        std::vector<detail::Point *> points;
+        for (detail::Point& p : storage) {
+          points.push_back(&p);
+        }
+        QuadTree quad_tree(points.begin(), points.end());
+        Assert::IsTrue(quad_tree.max_depth() >= 2);
+        for (const detail::Point& p : far) {
+          quad_tree.insert(p);
+        }
+
+        for (const detail::Point& p : storage) {
+          std::vector<detail::Point> found;
+          quad_tree.query({ p.x, p.y, p.x, p.y }, found);
+          Assert::IsTrue(std::any_of(found.begin(), found.end(),
+            [&p](const detail::Point& q)
+            {
+              return detail::same_point(p, q);
+            }));
+        }
+        for (const detail::Point& p : storage) {
+          Assert::IsTrue(quad_tree.erase(p));
+        }
+        std::vector<detail::Point> rest;
+        quad_tree.query(quad_tree.global_bounds(), rest);
+        Assert::AreEqual(far.size(), rest.size());
+      }
+    }
+
+    TEST_METHOD(TestMaxDepthFollowsInsertAndErase)
+    {
+      auto points = acquire_random_point_distributed_equally();
+      QuadTree quad_tree(points.begin(), points.end());
+      auto walked_depth = [&quad_tree]()
+        {
+          QuadTree::Stats stats;
+          quad_tree.compute_stats(stats);
+          return stats.nodes_per_depth.size() - 1;
+        };
+      const std::size_t initial = quad_tree.max_depth();
+      Assert::AreEqual(walked_depth(), initial);
+
+      // A tight cluster splits its leaf down several levels.
+      std::vector<detail::Point> cluster;
+      for (int32_t i = 0; i < 4 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        cluster.push_back({ i, i, frand(1.0f, 1.001f), frand(1.0f, 1.001f) });
+        quad_tree.insert(cluster.back());
+      }
+      Assert::IsTrue(quad_tree.max_depth() > initial);
+      Assert::AreEqual(walked_depth(),
+        static_cast<std::size_t>(quad_tree.max_depth()));
+
+      quad_tree.insert({ -1, 0, 1000.0f, -1000.0f });
+      Assert::AreEqual(walked_depth(),
+        static_cast<std::size_t>(quad_tree.max_depth()));
+
+      for (const detail::Point& p : cluster) {
+        Assert::IsTrue(quad_tree.erase(p));
+      }
+      Assert::AreEqual(walked_depth(),
+        static_cast<std::size_t>(quad_tree.max_depth()));
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestInsertIntoEmptyTree)
+    {
+      std::vector<detail::Point *> none;
+      QuadTree quad_tree(none.begin(), none.end());
+      for (int32_t i = 0; i < 3000; ++i) {
+        quad_tree.insert({ 0, i, frand(-50.0f, 50.0f), frand(0.0f, 10.0f) });
+      }
+      std::vector<detail::Point> all;
+      quad_tree.query(quad_tree.global_bounds(), all);
+      Assert::AreEqual(static_cast<std::size_t>(3000), all.size());
+      Assert::IsTrue(quad_tree.max_depth() >= 1);
+    }
+
+    TEST_METHOD(TestClustersPerDepth)
+    {
+      auto points = acquire_random_point_distributed_equally();
+      QuadTree quad_tree(points.begin(), points.end());
+      const detail::Rect& bounds = quad_tree.global_bounds();
+
+      auto check_depth = [&](std::size_t extra_count, uint8_t depth)
+      {
+        std::vector<QuadTree::Cluster> clusters;
+        quad_tree.clusters(bounds, depth, clusters);
+        std::size_t total = 0;
+        for (const QuadTree::Cluster& cluster : clusters) {
+          uint64_t count = 0;
+          double sum_x = 0.0;
+          int32_t top_rank = (std::numeric_limits<int32_t>::min)();
+          for (const detail::Point* p : points) {
+            if (detail::compute_quad_key(*p, depth, bounds) ==
+              cluster.quad_key) {
+              ++count;
+              sum_x += p->x;
+              top_rank = (std::max)(top_rank, p->rank);
+            }
+          }
+          Assert::AreEqual(count, cluster.count);
+          Assert::IsTrue(std::abs(sum_x / count - cluster.x) < 1e-3);
+          Assert::AreEqual(top_rank, cluster.top.rank);
+          total += cluster.count;
+        }
+        Assert::AreEqual(points.size() + extra_count, total);
+        return clusters.size();
+      };
+
+      Assert::AreEqual(static_cast<std::size_t>(1), check_depth(0, 0));
+      Assert::AreEqual(static_cast<std::size_t>(4), check_depth(0, 1));
+      Assert::AreEqual(static_cast<std::size_t>(16), check_depth(0, 2));
+
+      std::vector<QuadTree::Cluster> clusters;
+      quad_tree.clusters({ -15.0f, -15.0f, -9.0f, -9.0f }, 2, clusters);
+      Assert::AreEqual(static_cast<std::size_t>(1), clusters.size());
+      Assert::AreEqual(16ull, clusters[0].quad_key);
+
+      // Inserts keep the summaries on their path up to date.
+      detail::Point top = { 0, (std::numeric_limits<int32_t>::max)(),
+        +12.0f, +12.0f };
+      quad_tree.insert(top);
+      clusters.clear();
+      quad_tree.clusters(bounds, 0, clusters);
+      Assert::AreEqual(static_cast<uint64_t>(points.size() + 1),
+        clusters[0].count);
+      Assert::AreEqual(top.rank, clusters[0].top.rank);
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestComputeStats)
+    {
+      auto points = acquire_random_point_distributed_equally();
+      QuadTree quad_tree(points.begin(), points.end());
+
+      QuadTree::Stats stats;
+      quad_tree.compute_stats(stats);
+      Assert::AreEqual(points.size(), stats.point_count);
+      Assert::AreEqual(static_cast<std::size_t>(1), stats.nodes_per_depth[0]);
+      Assert::AreEqual(static_cast<std::size_t>(quad_tree.max_depth()) + 1,
+        stats.nodes_per_depth.size());
+      Assert::AreEqual(QuadTree::LEAF_FILL_BUCKETS + 1,
+        stats.leaf_fill_histogram.size());
+
+      std::size_t node_count = 0;
+      for (std::size_t count : stats.nodes_per_depth) {
+        node_count += count;
+      }
+      Assert::AreEqual(stats.node_count, node_count);
+
+      std::size_t leaf_count = 0;
+      for (std::size_t count : stats.leaf_fill_histogram) {
+        leaf_count += count;
+      }
+      Assert::AreEqual(stats.leaf_count, leaf_count);
+
+      std::size_t internal_count = stats.node_count - stats.leaf_count;
+      Assert::IsTrue(stats.empty_child_count <= 4 * internal_count);
+      Assert::IsTrue(stats.empty_child_ratio >= 0.0);
+      Assert::IsTrue(stats.empty_child_ratio <= 1.0);
+      Assert::IsTrue(stats.leaf_bytes >=
+        stats.point_count * sizeof(detail::Point));
+      Assert::AreEqual(sizeof(QuadTree) + stats.node_bytes + stats.leaf_bytes,
+        stats.total_bytes);
+      Assert::IsTrue(stats.build_timings.keying.count() > 0);
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestQueryWithTracer)
+    {
+      auto points = acquire_random_point_distributed_equally();
+      QuadTree quad_tree(points.begin(), points.end());
+
+      const detail::Rect rect = { -10.0f, -3.0f, +9.0f, +12.0f };
+      std::size_t expected = 0;
+      for (const detail::Point* p : points) {
+        if (detail::contains(rect, *p)) {
+          ++expected;
+        }
+      }
+
+      std::vector<detail::Point> untraced;
+      quad_tree.query(rect, untraced);
+      Assert::AreEqual(expected, untraced.size());
+
+      QueryTraceSink sink;
+      QueryTracer tracer(&sink);
+      std::vector<detail::Point> traced;
+      quad_tree.query(rect, traced, tracer);
+      Assert::AreEqual(expected, traced.size());
+      for (const detail::Point& p : traced) {
+        Assert::IsTrue(detail::contains(rect, p));
+      }
+
+      const QueryTrace& trace = tracer.trace;
+      Assert::AreEqual(static_cast<uint64_t>(expected), trace.points_emitted);
+      Assert::IsTrue(trace.nodes_visited >= trace.leaves_scanned);
+      Assert::IsTrue(trace.subtrees_accepted > 0);
+      Assert::IsTrue(trace.points_tested < points.size());
+
+      traced.clear();
+      quad_tree.query(rect, traced, tracer);
+
+      QueryTrace totals;
+      uint64_t query_count = 0;
+      sink.sample(totals, query_count);
+      Assert::AreEqual(static_cast<uint64_t>(2), query_count);
+      Assert::AreEqual(2 * trace.points_emitted, totals.points_emitted);
+      Assert::AreEqual(2 * trace.nodes_visited, totals.nodes_visited);
+
+      sink.reset();
+      sink.sample(totals, query_count);
+      Assert::AreEqual(static_cast<uint64_t>(0), query_count);
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestQuadTreeIndexQuery)
+    {
+      auto point_ptrs = acquire_random_point_distributed_equally();
+      std::vector<detail::Point> points;
+      for (const detail::Point* p : point_ptrs) {
+        points.push_back(*p);
+      }
+      release_resources(point_ptrs);
+
+      QuadTreeIndex index(points);
+      Assert::AreEqual(-16.0f, index.global_bounds().lx);
+      Assert::AreEqual(+16.0f, index.global_bounds().hy);
+      Assert::IsTrue(index.max_depth() >= 2);
+
+      std::vector<uint32_t> all;
+      index.query(index.global_bounds(), all);
+      Assert::AreEqual(points.size(), all.size());
+      std::sort(all.begin(), all.end());
+      for (std::size_t i = 0; i < all.size(); ++i) {
+        Assert::AreEqual(static_cast<uint32_t>(i), all[i]);
+      }
+
+      const detail::Rect rect = { -10.0f, -3.0f, +9.0f, +12.0f };
+      std::vector<uint32_t> expected;
+      for (std::size_t i = 0; i < points.size(); ++i) {
+        if (detail::contains(rect, points[i])) {
+          expected.push_back(static_cast<uint32_t>(i));
+        }
+      }
+      std::vector<uint32_t> actual;
+      index.query(rect, actual);
+      std::sort(actual.begin(), actual.end());
+      Assert::IsTrue(expected == actual);
+    }
+
+    TEST_METHOD(TestQuadTreeIndexUpdatePositions)
+    {
+      srand(11);
+      std::vector<detail::Point> points;
+      for (std::size_t i = 0; i < 20 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        points.push_back({
+          static_cast<int8_t>(i), static_cast<int32_t>(i),
+          frand(-16.0f, +16.0f), frand(-16.0f, +16.0f)
+        });
+      }
+      QuadTreeIndex index(points);
+
+      auto check = [&](const detail::Rect& rect)
+      {
+        std::vector<uint32_t> expected;
+        for (std::size_t i = 0; i < points.size(); ++i) {
+          if (detail::contains(rect, points[i])) {
+            expected.push_back(static_cast<uint32_t>(i));
+          }
+        }
+        std::vector<uint32_t> actual;
+        index.query(rect, actual);
+        std::sort(actual.begin(), actual.end());
+        Assert::IsTrue(expected == actual);
+      };
+
+      for (std::size_t tick = 0; tick < 5; ++tick) {
+        // Every point jitters a little; a few jump across the map.
+        for (std::size_t i = 0; i < points.size(); ++i) {
+          detail::Point& p = points[i];
+          if (i % 97 == tick) {
+            p.x = frand(-16.0f, +16.0f);
+            p.y = frand(-16.0f, +16.0f);
+          } else {
+            float x = p.x + frand(-0.05f, +0.05f);
+            float y = p.y + frand(-0.05f, +0.05f);
+            p.x = (std::min)(+16.0f, (std::max)(-16.0f, x));
+            p.y = (std::min)(+16.0f, (std::max)(-16.0f, y));
+          }
+        }
+        index.update_positions(points);
+        check(index.global_bounds());
+        check({ -10.0f, -3.0f, +9.0f, +12.0f });
+        check({ +1.0f, +1.0f, +1.5f, +1.5f });
+      }
+
+      // Gathering most of the points in one corner splits the leaves there
+      // and collapses the emptied ones elsewhere.
+      for (std::size_t i = 0; i < points.size(); i += 2) {
+        points[i].x = frand(-16.0f, -15.0f);
+        points[i].y = frand(-16.0f, -15.0f);
+      }
+      index.update_positions(points);
+      check(index.global_bounds());
+      check({ -16.0f, -16.0f, -15.5f, -15.5f });
+      Assert::IsTrue(index.max_depth() >= 5);
+      Assert::AreEqual(QuadTreeIndex(points).max_depth(), index.max_depth());
+
+      // Leaving the bounds falls back to a rebuild.
+      points[0].x = +100.0f;
+      index.update_positions(points);
+      Assert::AreEqual(+100.0f, index.global_bounds().hx);
+      check(index.global_bounds());
+      check({ -10.0f, -3.0f, +9.0f, +12.0f });
+    }
+
+    TEST_METHOD(TestLooseQuadTreeQueries)
+    {
+      srand(5);
+      std::vector<detail::Rect> rects;
+      for (std::size_t i = 0; i < 10 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        // Mostly small buildings with a few long road segments.
+        float size = (i % 50 == 0) ? frand(5.0f, 20.0f) : frand(0.01f, 0.5f);
+        float x = frand(-100.0f, +100.0f);
+        float y = frand(-100.0f, +100.0f);
+        float aspect = frand(0.2f, 1.0f);
+        rects.push_back({ x, y, x + size, y + size * aspect });
+      }
+      LooseQuadTree tree(rects);
+      Assert::IsTrue(tree.max_depth() >= 2);
+
+      std::vector<detail::Rect> queries = {
+        { -10.0f, -10.0f, +10.0f, +10.0f },
+        { +50.0f, -90.0f, +51.0f, +90.0f },
+        tree.global_bounds(),
+      };
+      for (const detail::Rect& query : queries) {
+        std::vector<uint32_t> expected;
+        for (std::size_t i = 0; i < rects.size(); ++i) {
+          if (detail::intersects(query, rects[i])) {
+            expected.push_back(static_cast<uint32_t>(i));
+          }
+        }
+        std::vector<uint32_t> actual;
+        tree.query(query, actual);
+        std::sort(actual.begin(), actual.end());
+        Assert::IsTrue(expected == actual);
+      }
+
+      for (std::size_t n = 0; n < 200; ++n) {
+        detail::Point p = { 0, 0, frand(-100.0f, +100.0f),
+          frand(-100.0f, +100.0f) };
+        std::vector<uint32_t> expected;
+        for (std::size_t i = 0; i < rects.size(); ++i) {
+          if (detail::contains(rects[i], p)) {
+            expected.push_back(static_cast<uint32_t>(i));
+          }
+        }
+        std::vector<uint32_t> actual;
+        tree.stab(p, actual);
+        std::sort(actual.begin(), actual.end());
+        Assert::IsTrue(expected == actual);
+      }
+    }
+
+    TEST_METHOD(TestRadiusAndNearestQueries)
+    {
+      auto points = acquire_random_point_distributed_equally();
+      QuadTree quad_tree(points.begin(), points.end());
+
+      const float x = 3.5f;
+      const float y = -2.25f;
+      const float radius = 6.0f;
+      std::size_t expected = 0;
+      std::vector<float> distances;
+      for (const detail::Point* p : points) {
+        float dx = p->x - x;
+        float dy = p->y - y;
+        expected += (dx * dx + dy * dy <= radius * radius) ? 1 : 0;
+        distances.push_back(dx * dx + dy * dy);
+      }
+      std::sort(distances.begin(), distances.end());
+
+      std::vector<detail::Point> found;
+      quad_tree.query_radius(x, y, radius, found);
+      Assert::AreEqual(expected, found.size());
+
+      std::vector<detail::Point> nearest;
+      quad_tree.nearest(x, y, 25, nearest);
+      Assert::AreEqual(static_cast<std::size_t>(25), nearest.size());
+      for (std::size_t i = 0; i < nearest.size(); ++i) {
+        float dx = nearest[i].x - x;
+        float dy = nearest[i].y - y;
+        Assert::AreEqual(distances[i], dx * dx + dy * dy);
+      }
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestQueryExecutor)
+    {
+      srand(3);
+      std::vector<detail::Point *> points;
+      for (std::size_t i = 0; i < 100 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        points.push_back(new detail::Point {
+          static_cast<int8_t>(i), static_cast<int32_t>(i),
+          frand(-16.0f, +16.0f), frand(-16.0f, +16.0f)
+        });
+      }
+      QuadTree quad_tree(points.begin(), points.end());
+      ThreadPool pool(4);
+      QueryExecutor executor(quad_tree, pool);
+
+      // Large enough to be split into per-subtree subtasks.
+      const detail::Rect big = { -15.0f, -15.0f, +15.0f, +15.0f };
+      std::vector<detail::Point> expected_big;
+      quad_tree.query(big, expected_big);
+      Assert::IsTrue(expected_big.size() > QueryExecutor::SPLIT_POINT_COUNT);
+
+      auto big_future = executor.submit(QueryDescriptor::within(big));
+      auto radius_future = executor.submit(
+        QueryDescriptor::within_radius(1.0f, 2.0f, 3.0f));
+      auto nearest_future = executor.submit(
+        QueryDescriptor::nearest(1.0f, 2.0f, 10));
+      auto negative_future = executor.submit(
+        QueryDescriptor::within_radius(1.0f, 2.0f, -3.0f));
+
+      std::vector<detail::Point> expected_radius;
+      quad_tree.query_radius(1.0f, 2.0f, 3.0f, expected_radius);
+      std::vector<detail::Point> expected_nearest;
+      quad_tree.nearest(1.0f, 2.0f, 10, expected_nearest);
+
+      Assert::AreEqual(expected_big.size(), big_future.get().size());
+      Assert::AreEqual(expected_radius.size(), radius_future.get().size());
+      Assert::IsTrue(negative_future.get().empty());
+      auto nearest = nearest_future.get();
+      Assert::AreEqual(expected_nearest.size(), nearest.size());
+      for (std::size_t i = 0; i < nearest.size(); ++i) {
+        Assert::AreEqual(expected_nearest[i].rank, nearest[i].rank);
+      }
+
+      std::promise<std::size_t> callback_count;
+      executor.submit(QueryDescriptor::within(big),
+        [&](std::exception_ptr error, QueryExecutor::Result_t result)
+        {
+          callback_count.set_value(error ? 0 : result.size());
+        });
+      Assert::AreEqual(expected_big.size(), callback_count.get_future().get());
+
+      std::promise<std::size_t> awaited_count;
+      auto awaiting = [&]() -> FireAndForget
+      {
+        auto result = co_await executor.async(
+          QueryDescriptor::within_radius(1.0f, 2.0f, 3.0f));
+        awaited_count.set_value(result.size());
+      };
+      awaiting();
+      Assert::AreEqual(expected_radius.size(),
+        awaited_count.get_future().get());
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestSpatialJoinMatchesBruteForce)
+    {
+      srand(42);
+      std::vector<detail::Point *> vehicles;
+      for (std::size_t i = 0; i < 3 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        vehicles.push_back(new detail::Point {
+          static_cast<int8_t>(i), static_cast<int32_t>(i),
+          frand(-16.0f, +16.0f), frand(-16.0f, +16.0f)
+        });
+      }
+      std::vector<detail::Point *> depots;
+      for (std::size_t i = 0; i < 2 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        depots.push_back(new detail::Point {
+          static_cast<int8_t>(i), static_cast<int32_t>(i),
+          frand(-4.0f, +24.0f), frand(-20.0f, +8.0f)
+        });
+      }
+
+      const float distance = 0.5f;
+      std::size_t expected = 0;
+      for (const detail::Point* v : vehicles) {
+        for (const detail::Point* d : depots) {
+          float dx = v->x - d->x;
+          float dy = v->y - d->y;
+          if (dx * dx + dy * dy <= distance * distance) {
+            ++expected;
+          }
+        }
+      }
+
+      QuadTree vehicle_tree(vehicles.begin(), vehicles.end());
+      QuadTree depot_tree(depots.begin(), depots.end());
+      for (std::size_t thread_count : { 1, 4 }) {
+        std::vector<QuadTree::PointPair_t> pairs;
+        vehicle_tree.spatial_join(depot_tree, distance, pairs, thread_count);
+        Assert::AreEqual(expected, pairs.size());
+        for (const QuadTree::PointPair_t& pair : pairs) {
+          float dx = pair.first.x - pair.second.x;
+          float dy = pair.first.y - pair.second.y;
+          Assert::IsTrue(dx * dx + dy * dy <= distance * distance);
+        }
+      }
+
+      release_resources(vehicles);
+      release_resources(depots);
+    }
+
+    TEST_METHOD(TestShardedQuadTreeMatchesQuadTree)
+    {
+      auto points = acquire_random_point_distributed_equally();
+      QuadTree tree(points.begin(), points.end());
+      ShardedQuadTree sharded(points.begin(), points.end(), 2, 3);
+      Assert::AreEqual(static_cast<std::size_t>(16), sharded.shard_count());
+      Assert::AreEqual(detail::min_id(2), sharded.shard_key(0));
+      Assert::AreEqual(detail::max_id(2), sharded.shard_key(15));
+
+      std::size_t sharded_points = 0;
+      for (std::size_t i = 0; i < sharded.shard_count(); ++i) {
+        QuadTree::Stats stats;
+        Assert::IsTrue(sharded.shard(i) != nullptr);
+        sharded.shard(i)->compute_stats(stats);
+        sharded_points += stats.point_count;
+      }
+      Assert::AreEqual(points.size(), sharded_points);
+
+      const detail::Rect corner = { -16.0f, -16.0f, -9.0f, -9.0f };
+      std::vector<std::size_t> routed;
+      sharded.route(corner, routed);
+      Assert::AreEqual(static_cast<std::size_t>(1), routed.size());
+      Assert::AreEqual(static_cast<std::size_t>(0), routed[0]);
+
+      auto by_position = [](const detail::Point& lhs,
+        const detail::Point& rhs)
+        {
+          return lhs.x < rhs.x || (lhs.x == rhs.x && lhs.y < rhs.y);
+        };
+      const detail::Rect rect = { -10.0f, -3.0f, +9.0f, +12.0f };
+      std::vector<detail::Point> expected;
+      tree.query(rect, expected);
+      std::vector<detail::Point> actual;
+      sharded.query(rect, actual);
+      Assert::AreEqual(expected.size(), actual.size());
+      std::sort(expected.begin(), expected.end(), by_position);
+      std::sort(actual.begin(), actual.end(), by_position);
+      for (std::size_t i = 0; i < expected.size(); ++i) {
+        Assert::AreEqual(expected[i].x, actual[i].x);
+        Assert::AreEqual(expected[i].y, actual[i].y);
+      }
+
+      expected.clear();
+      actual.clear();
+      tree.query_radius(0.0f, 0.0f, 5.0f, expected);
+      sharded.query_radius(0.0f, 0.0f, 5.0f, actual);
+      Assert::AreEqual(expected.size(), actual.size());
+
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestNeighbourLeaves)
+    {
+      auto points = acquire_random_point_distributed_equally();
+      QuadTree tree(points.begin(), points.end());
+      auto cell_of = [&tree](uint64_t key)
+        {
+          uint8_t depth = detail::keys::key_depth(key);
+          detail::Rect cell = tree.global_bounds();
+          for (uint8_t level = 1; level <= depth; ++level) {
+            cell = detail::child_rect(cell,
+              (key >> (2u * (depth - level))) & 0x3);
+          }
+          return cell;
+        };
+
+      const uint64_t corner = tree.leaf_key(-16.0f, -16.0f);
+      Assert::IsTrue(detail::keys::is_valid(corner));
+      std::vector<uint64_t> keys;
+      tree.neighbour_leaves(corner, detail::keys::Direction::West, keys);
+      tree.neighbour_leaves(corner, detail::keys::Direction::South, keys);
+      Assert::IsTrue(keys.empty());
+
+      const uint64_t leaf = tree.leaf_key(-1.0f, +2.0f);
+      const detail::Rect cell = cell_of(leaf);
+      std::vector<detail::Point> leaf_points;
+      tree.leaf_points(leaf, leaf_points);
+      Assert::IsFalse(leaf_points.empty());
+
+      tree.neighbour_leaves(leaf, detail::keys::Direction::East, keys);
+      Assert::IsFalse(keys.empty());
+      for (uint64_t key : keys) {
+        detail::Rect neighbour = cell_of(key);
+        Assert::AreEqual(cell.hx, neighbour.lx);
+        Assert::IsTrue(neighbour.ly <= cell.hy && cell.ly <= neighbour.hy);
+      }
+      for (float t : { 0.0f, 0.25f, 0.5f, 0.75f }) {
+        uint64_t key = tree.leaf_key(cell.hx,
+          cell.ly + t * (cell.hy - cell.ly));
+        Assert::IsTrue(std::find(keys.begin(), keys.end(), key) !=
+          keys.end());
+      }
+
+      keys.clear();
+      tree.neighbour_leaves(leaf, detail::keys::Direction::NorthEast, keys);
+      Assert::AreEqual(static_cast<std::size_t>(1), keys.size());
+      Assert::AreEqual(tree.leaf_key(cell.hx, cell.hy), keys[0]);
+
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestComputeKeyRanges)
+    {
+      auto points = acquire_random_point_distributed_equally();
+      detail::Rect bounds;
+      QuadTree::compute_bounds(points.begin(), points.end(), bounds);
+      const detail::Rect rect = { -10.0f, -3.0f, +9.0f, +12.0f };
+      const uint8_t depth = 8;
+
+      auto covered = [](const std::vector<detail::KeyRange>& ranges,
+        uint64_t key)
+        {
+          for (const detail::KeyRange& range : ranges) {
+            if (key >= range.lo && key <= range.hi) {
+              return true;
+            }
+          }
+          return false;
+        };
+
+      std::vector<detail::KeyRange> exact;
+      detail::compute_key_ranges(rect, bounds, depth, 0, exact);
+      std::vector<detail::KeyRange> bounded;
+      detail::compute_key_ranges(rect, bounds, depth, 4, bounded);
+      Assert::IsTrue(exact.size() > 4);
+      Assert::IsTrue(!bounded.empty() && bounded.size() <= 4);
+      // At full depth the boundary alone spans millions of cells; the
+      // budget must hold the descent to a handful of them.
+      std::vector<detail::KeyRange> deep;
+      detail::compute_key_ranges(rect, bounds, detail::max_depth(), 16, deep);
+      Assert::IsTrue(!deep.empty() && deep.size() <= 16);
+      for (const auto* ranges : { &exact, &bounded }) {
+        for (std::size_t i = 0; i < ranges->size(); ++i) {
+          Assert::IsTrue((*ranges)[i].lo <= (*ranges)[i].hi);
+          Assert::IsTrue((*ranges)[i].lo >= detail::min_id(depth));
+          Assert::IsTrue((*ranges)[i].hi <= detail::max_id(depth));
+          if (i > 0) {
+            Assert::IsTrue((*ranges)[i - 1].hi + 1 < (*ranges)[i].lo);
+          }
+        }
+      }
+
+      for (const detail::Point* p : points) {
+        uint64_t key = detail::compute_quad_key(*p, depth, bounds);
+        if (detail::contains(rect, *p)) {
+          Assert::IsTrue(covered(exact, key));
+          Assert::IsTrue(covered(bounded, key));
+          Assert::IsTrue(covered(deep, detail::compute_quad_key(*p,
+            detail::max_depth(), bounds)));
+        } else if (covered(exact, key)) {
+          // Only cells straddling the edge of rect may hold outside points.
+          Assert::IsTrue(p->x >= rect.lx - 0.2f && p->x <= rect.hx + 0.2f &&
+            p->y >= rect.ly - 0.2f && p->y <= rect.hy + 0.2f);
+        }
+      }
+
+      std::vector<detail::KeyRange> all;
+      detail::compute_key_ranges(bounds, bounds, depth, 0, all);
+      Assert::AreEqual(static_cast<std::size_t>(1), all.size());
+      Assert::AreEqual(detail::min_id(depth), all[0].lo);
+      Assert::AreEqual(detail::max_id(depth), all[0].hi);
+
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestStaticQuadIndexQuery)
+    {
+      auto point_ptrs = acquire_random_point_distributed_equally();
+      std::vector<detail::Point> points;
+      for (const detail::Point* p : point_ptrs) {
+        points.push_back(*p);
+      }
+      QuadTree tree(point_ptrs.begin(), point_ptrs.end());
+      release_resources(point_ptrs);
+
+      StaticQuadIndex index(points);
+      Assert::AreEqual(points.size(), index.points().size());
+      for (std::size_t i = 0; i < index.points().size(); i += 97) {
+        uint64_t key = detail::compute_quad_key(index.points()[i],
+          detail::max_depth(), index.global_bounds());
+        std::size_t first = index.lower_bound(key);
+        Assert::IsTrue(first <= i);
+        Assert::AreEqual(key, detail::compute_quad_key(
+          index.points()[first], detail::max_depth(),
+          index.global_bounds()));
+      }
+      Assert::AreEqual(static_cast<std::size_t>(0),
+        index.lower_bound(detail::min_id(detail::max_depth())));
+      Assert::AreEqual(points.size(),
+        index.lower_bound(detail::max_id(detail::max_depth()) + 1));
+
+      auto by_position = [](const detail::Point& lhs,
+        const detail::Point& rhs)
+        {
+          return lhs.x < rhs.x || (lhs.x == rhs.x && lhs.y < rhs.y);
+        };
+      const detail::Rect rects[] = {
+        { -10.0f, -3.0f, +9.0f, +12.0f },
+        { -0.5f, -0.5f, +0.25f, +0.75f },
+        { -20.0f, -20.0f, +20.0f, +20.0f },
+        { +17.0f, +17.0f, +18.0f, +18.0f }
+      };
+      for (const detail::Rect& rect : rects) {
+        std::vector<detail::Point> expected;
+        tree.query(rect, expected);
+        std::vector<detail::Point> actual;
+        index.query(rect, actual);
+        Assert::AreEqual(expected.size(), actual.size());
+        std::sort(expected.begin(), expected.end(), by_position);
+        std::sort(actual.begin(), actual.end(), by_position);
+        for (std::size_t i = 0; i < expected.size(); ++i) {
+          Assert::AreEqual(expected[i].x, actual[i].x);
+          Assert::AreEqual(expected[i].y, actual[i].y);
+        }
+      }
+    }
+
+    TEST_METHOD(TestInPlaceBuildMatchesBufferedBuild)
+    {
+      auto points = acquire_random_point_distributed_equally();
+      std::vector<detail::Point *> reordered(points);
+      QuadTree buffered(points.begin(), points.end());
+      QuadTree in_place(reordered.begin(), reordered.end(),
+        QuadTree::BuildMode::InPlace);
+
+      QuadTree::Stats expected;
+      buffered.compute_stats(expected);
+      QuadTree::Stats actual;
+      in_place.compute_stats(actual);
+      Assert::AreEqual(expected.node_count, actual.node_count);
+      Assert::AreEqual(expected.leaf_count, actual.leaf_count);
+      Assert::AreEqual(expected.point_count, actual.point_count);
+      Assert::IsTrue(expected.nodes_per_depth == actual.nodes_per_depth);
+
+      const detail::Rect rect = { -10.0f, -3.0f, +9.0f, +12.0f };
+      std::vector<detail::Point> expected_points;
+      buffered.query(rect, expected_points);
+      std::vector<detail::Point> actual_points;
+      in_place.query(rect, actual_points);
+      Assert::AreEqual(expected_points.size(), actual_points.size());
+
+      // The input is only reordered.
+      std::sort(reordered.begin(), reordered.end());
+      std::vector<detail::Point *> sorted(points);
+      std::sort(sorted.begin(), sorted.end());
+      Assert::IsTrue(sorted == reordered);
+
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestPersistentQuadTreeSnapshots)
+    {
+      auto point_ptrs = acquire_random_point_distributed_equally();
+      std::vector<detail::Point> points;
+      for (const detail::Point* p : point_ptrs) {
+        points.push_back(*p);
+      }
+      release_resources(point_ptrs);
+
+      PersistentQuadTree tree(points);
+      const PersistentQuadTree::Snapshot before = tree.snapshot();
+      Assert::AreEqual(points.size(), before.size());
+      Assert::AreEqual(static_cast<uint64_t>(0), before.version());
+
+      const detail::Rect rect = { -10.0f, -3.0f, +9.0f, +12.0f };
+      std::vector<detail::Point> expected;
+      for (const detail::Point& p : points) {
+        if (detail::contains(rect, p)) {
+          expected.push_back(p);
+        }
+      }
+      std::vector<detail::Point> actual;
+      before.query(rect, actual);
+      Assert::AreEqual(expected.size(), actual.size());
+
+      // Updates run while another thread keeps reading the old snapshot.
+      std::atomic<bool> done = false;
+      std::atomic<bool> consistent = true;
+      std::thread reader([&]()
+        {
+          while (!done) {
+            std::vector<detail::Point> seen;
+            before.query(rect, seen);
+            if (seen.size() != expected.size()) {
+              consistent = false;
+            }
+          }
+        });
+
+      srand(5);
+      std::size_t inserted_inside = 0;
+      for (std::size_t i = 0; i < 3 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        detail::Point p = { 0, static_cast<int32_t>(100000 + i),
+          frand(-4.0f, +4.0f), frand(0.0f, +4.0f) };
+        tree.insert(p);
+        inserted_inside += detail::contains(rect, p) ? 1 : 0;
+      }
+      std::size_t erased_inside = 0;
+      for (std::size_t i = 0; i < points.size(); i += 2) {
+        Assert::IsTrue(tree.erase(points[i]));
+        erased_inside += detail::contains(rect, points[i]) ? 1 : 0;
+      }
+      Assert::IsFalse(tree.erase(points[0]));
+      tree.insert({ 0, -1, +40.0f, -35.0f });
+      done = true;
+      reader.join();
+      Assert::IsTrue(consistent);
+
+      const PersistentQuadTree::Snapshot after = tree.snapshot();
+      Assert::AreEqual(points.size() + 3 * QuadTree::MAX_BLOCK_SIZE + 1 -
+        (points.size() + 1) / 2, after.size());
+      Assert::IsTrue(after.version() > before.version());
+      Assert::IsTrue(after.global_bounds().hx >= 40.0f);
+      Assert::IsTrue(after.global_bounds().ly <= -35.0f);
+
+      actual.clear();
+      after.query(rect, actual);
+      Assert::AreEqual(expected.size() + inserted_inside - erased_inside,
+        actual.size());
+      actual.clear();
+      before.query(rect, actual);
+      Assert::AreEqual(expected.size(), actual.size());
+      Assert::AreEqual(points.size(), before.size());
+    }
+
+    TEST_METHOD(TestPersistentQuadTreeAlternatingGrowth)
+    {
+      // A dense cluster near the top edge reaches deep leaves, and each far
+      // point grows the root in the opposite direction to the last. Every
+      // original point must stay visible and erasable.
+      const std::vector<detail::Point> far = {
+        { -1, 0, +29.2f, -12.4f },
+        { -2, 0, -36.4f, +22.8f },
+        { -3, 0, +116.8f, -49.6f },
+        { -4, 0, -145.6f, +91.2f },
+        { -5, 0, +467.2f, -198.4f },
+        { -6, 0, -582.4f, +364.8f },
+      };
+      for (unsigned seed = 1; seed <= 3; ++seed) {
+        srand(seed);
+        std::vector<detail::Point> points;
+        for (int32_t i = 0; i < 10000; ++i) {
+          points.push_back({ i, i, frand(-10.0f, 10.0f),
+            frand(-10.0f, 10.0f) });
+        }
+        for (int32_t i = 10000; i < 15000; ++i) {
+          points.push_back({ i, i, frand(6.15f, 6.17f),
+            frand(9.97f, 10.0f) });
+        }
+        PersistentQuadTree tree(points);
+        for (const detail::Point& p : far) {
+          tree.insert(p);
+        }
+
+        for (const detail::Point& p : points) {
+          std::vector<detail::Point> found;
+          tree.query({ p.x, p.y, p.x, p.y }, found);
+          Assert::IsTrue(std::any_of(found.begin(), found.end(),
+            [&p](const detail::Point& q)
+            {
+              return detail::same_point(p, q);
+            }));
+        }
+
+        // Random inserts and erases keep the size in step, collapsing and
+        // rebuilding subtrees below the grown roots as they go.
+        std::vector<detail::Point> live(points);
+        for (int32_t i = 0; i < 10000; ++i) {
+          if (rand() % 2 == 0 || live.empty()) {
+            live.push_back({ 15000 + i, i, frand(-12.0f, 12.0f),
+              frand(-12.0f, 12.0f) });
+            tree.insert(live.back());
+          } else {
+            std::size_t k = rand() % live.size();
+            Assert::IsTrue(tree.erase(live[k]));
+            live[k] = live.back();
+            live.pop_back();
+          }
+          Assert::AreEqual(live.size() + far.size(), tree.size());
+        }
+        for (const detail::Point& p : live) {
+          Assert::IsTrue(tree.erase(p));
+        }
+        Assert::AreEqual(far.size(), tree.size());
+      }
+    }
+
+    TEST_METHOD(TestChangeLogReplication)
+    {
+      auto points = acquire_random_point_distributed_equally();
+      QuadTree primary(points.begin(), points.end());
+      std::stringstream checkpoint;
+      primary.write_checkpoint(checkpoint);
+
+      ChangeLog log;
+      primary.set_change_log(&log);
+      srand(17);
+      for (std::size_t i = 0; i < 2 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        primary.insert({ 1, static_cast<int32_t>(i),
+          frand(+1.0f, +3.0f), frand(+1.0f, +3.0f) });
+      }
+      primary.insert({ 2, 0, -40.0f, +25.0f });
+      for (std::size_t i = 0; i < points.size(); i += 3) {
+        Assert::IsTrue(primary.erase(*points[i]));
+      }
+      Assert::IsFalse(primary.erase(*points[0]));
+      for (std::size_t i = 1; i < points.size(); i += 3) {
+        Assert::IsTrue(primary.move(*points[i], points[i]->y,
+          -points[i]->x));
+      }
+      Assert::IsTrue(primary.move(*points[2], +70.0f, -70.0f));
+      Assert::IsTrue(log.record_count() > 0);
+
+      std::vector<detail::Point *> none;
+      QuadTree replica(none.begin(), none.end());
+      replica.read_checkpoint(checkpoint);
+      replica.apply_log(log.data());
+
+      Assert::AreEqual(primary.global_bounds().lx,
+        replica.global_bounds().lx);
+      Assert::AreEqual(primary.global_bounds().hy,
+        replica.global_bounds().hy);
+      std::stringstream expected;
+      primary.write_checkpoint(expected);
+      std::stringstream actual;
+      replica.write_checkpoint(actual);
+      Assert::IsTrue(expected.str() == actual.str());
+
+      QuadTree::Stats stats;
+      replica.compute_stats(stats);
+      Assert::AreEqual(points.size() + 2 * QuadTree::MAX_BLOCK_SIZE + 1 -
+        (points.size() + 2) / 3, stats.point_count);
+
+      // A log started on an empty tree replays onto an empty tree.
+      QuadTree empty_primary(none.begin(), none.end());
+      ChangeLog empty_log;
+      empty_primary.set_change_log(&empty_log);
+      empty_primary.insert({ 0, 1, 3.0f, 4.0f });
+      empty_primary.insert({ 0, 2, 9.0f, -2.0f });
+      QuadTree empty_replica(none.begin(), none.end());
+      empty_replica.apply_log(empty_log.data());
+      std::vector<detail::Point> found;
+      empty_replica.query(empty_primary.global_bounds(), found);
+      Assert::AreEqual(static_cast<std::size_t>(2), found.size());
+
+      // Only the fields are logged, whatever the padding holds.
+      alignas(detail::Point) unsigned char zeroed[sizeof(detail::Point)];
+      alignas(detail::Point) unsigned char filled[sizeof(detail::Point)];
+      std::fill(std::begin(zeroed), std::end(zeroed), 0x00);
+      std::fill(std::begin(filled), std::end(filled), 0xff);
+      for (unsigned char* bytes : { zeroed, filled }) {
+        detail::Point* p = reinterpret_cast<detail::Point*>(bytes);
+        p->id = 7;
+        p->rank = 8;
+        p->x = 1.5f;
+        p->y = -2.5f;
+      }
+      ChangeLog zeroed_log;
+      zeroed_log.append_insert(5, *reinterpret_cast<detail::Point*>(zeroed));
+      ChangeLog filled_log;
+      filled_log.append_insert(5, *reinterpret_cast<detail::Point*>(filled));
+      Assert::IsTrue(std::equal(zeroed_log.data().begin(),
+        zeroed_log.data().end(), filled_log.data().begin(),
+        filled_log.data().end()));
+
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestNeighbourCountsAndDbscan)
+    {
+      srand(23);
+      std::vector<detail::Point *> points;
+      const float centers[3][2] = { { -8.0f, -8.0f }, { 6.0f, 2.0f },
+        { -3.0f, 9.0f } };
+      for (std::size_t i = 0; i < 4500; ++i) {
+        float x = frand(-16.0f, +16.0f);
+        float y = frand(-16.0f, +16.0f);
+        if (i % 5 != 0) {
+          const float* c = centers[i % 3];
+          x = c[0] + frand(-2.0f, +2.0f);
+          y = c[1] + frand(-2.0f, +2.0f);
+        }
+        points.push_back(new detail::Point {
+          0, static_cast<int32_t>(i), x, y });
+      }
+      QuadTree tree(points.begin(), points.end());
+
+      const float radius = 0.3f;
+      const std::size_t min_points = 6;
+      std::vector<detail::Point> ordered;
+      std::vector<uint32_t> counts;
+      tree.neighbour_counts(radius, ordered, counts, 4);
+      Assert::AreEqual(points.size(), ordered.size());
+
+      auto within = [radius](const detail::Point& a, const detail::Point& b)
+        {
+          float dx = a.x - b.x;
+          float dy = a.y - b.y;
+          return dx * dx + dy * dy <= radius * radius;
+        };
+      const std::size_t n = ordered.size();
+      std::vector<std::vector<std::size_t>> neighbours(n);
+      for (std::size_t i = 0; i < n; ++i) {
+        for (std::size_t j = 0; j < n; ++j) {
+          if (within(ordered[i], ordered[j])) {
+            neighbours[i].push_back(j);
+          }
+        }
+        Assert::AreEqual(neighbours[i].size(),
+          static_cast<std::size_t>(counts[i]));
+      }
+
+      std::vector<detail::Point> labelled;
+      std::vector<int32_t> labels;
+      tree.dbscan(radius, min_points, labelled, labels, 4);
+      Assert::AreEqual(n, labels.size());
+
+      // Core points share a label exactly when they are connected through
+      // core points, counted here with a breadth first search.
+      std::vector<int32_t> components(n, QuadTree::NOISE);
+      int32_t component_count = 0;
+      for (std::size_t i = 0; i < n; ++i) {
+        if (neighbours[i].size() < min_points ||
+          components[i] != QuadTree::NOISE) {
+          continue;
+        }
+        std::vector<std::size_t> frontier = { i };
+        components[i] = component_count;
+        while (!frontier.empty()) {
+          std::size_t p = frontier.back();
+          frontier.pop_back();
+          for (std::size_t q : neighbours[p]) {
+            if (neighbours[q].size() >= min_points &&
+              components[q] == QuadTree::NOISE) {
+              components[q] = component_count;
+              frontier.push_back(q);
+            }
+          }
+        }
+        ++component_count;
+      }
+      Assert::IsTrue(component_count >= 3);
+
+      std::vector<int32_t> label_of_component(component_count,
+        QuadTree::NOISE);
+      int32_t max_label = QuadTree::NOISE;
+      for (std::size_t i = 0; i < n; ++i) {
+        max_label = (std::max)(max_label, labels[i]);
+        if (components[i] != QuadTree::NOISE) {
+          int32_t& label = label_of_component[components[i]];
+          if (label == QuadTree::NOISE) {
+            label = labels[i];
+          }
+          Assert::AreEqual(label, labels[i]);
+          continue;
+        }
+        // Border points take the label of a core neighbour; noise has none.
+        bool has_core = false;
+        bool label_found = false;
+        for (std::size_t q : neighbours[i]) {
+          if (components[q] != QuadTree::NOISE) {
+            has_core = true;
+            label_found = label_found || labels[q] == labels[i];
+          }
+        }
+        Assert::AreEqual(has_core, labels[i] != QuadTree::NOISE);
+        Assert::IsTrue(!has_core || label_found);
+      }
+      Assert::AreEqual(component_count, max_label + 1);
+      std::sort(label_of_component.begin(), label_of_component.end());
+      Assert::IsTrue(std::unique(label_of_component.begin(),
+        label_of_component.end()) == label_of_component.end());
+
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestCursorFollowsTrack)
+    {
+      srand(29);
+      std::vector<detail::Point *> points;
+      for (std::size_t i = 0; i < 40 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        points.push_back(new detail::Point {
+          0, static_cast<int32_t>(i),
+          frand(-16.0f, +16.0f), frand(-16.0f, +16.0f)
+        });
+      }
+      QuadTree tree(points.begin(), points.end());
+      QuadTree::Cursor cursor(tree);
+      Assert::AreEqual(static_cast<uint64_t>(0), cursor.finger_key());
+
+      auto by_position = [](const detail::Point& lhs,
+        const detail::Point& rhs)
+        {
+          return lhs.x < rhs.x || (lhs.x == rhs.x && lhs.y < rhs.y);
+        };
+      uint64_t tree_nodes = 0;
+      uint64_t cursor_nodes = 0;
+      for (int step = 0; step < 200; ++step) {
+        float x = -15.0f + 0.14f * step;
+        float y = -12.0f + 0.1f * step;
+        const detail::Rect rect = { x, y, x + 0.4f, y + 0.3f };
+
+        QueryTracer tree_tracer;
+        std::vector<detail::Point> expected;
+        tree.query(rect, expected, tree_tracer);
+        QueryTracer cursor_tracer;
+        std::vector<detail::Point> actual;
+        cursor.query(rect, actual, cursor_tracer);
+        tree_nodes += tree_tracer.trace.nodes_visited;
+        cursor_nodes += cursor_tracer.trace.nodes_visited;
+
+        Assert::AreEqual(expected.size(), actual.size());
+        std::sort(expected.begin(), expected.end(), by_position);
+        std::sort(actual.begin(), actual.end(), by_position);
+        for (std::size_t i = 0; i < expected.size(); ++i) {
+          Assert::AreEqual(expected[i].x, actual[i].x);
+          Assert::AreEqual(expected[i].y, actual[i].y);
+        }
+        if (step == 0) {
+          Assert::IsTrue(detail::keys::key_depth(cursor.finger_key()) > 1);
+        }
+      }
+      Assert::IsTrue(2 * cursor_nodes < tree_nodes);
+
+      // A mutation drops the finger rather than leaving it dangling.
+      tree.insert({ 0, -1, +30.0f, +30.0f });
+      const detail::Rect everything = { -40.0f, -40.0f, +40.0f, +40.0f };
+      std::vector<detail::Point> all;
+      cursor.query(everything, all);
+      Assert::AreEqual(points.size() + 1, all.size());
+      Assert::AreEqual(detail::min_id(0), cursor.finger_key());
+
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestSegmentQueryAndFirstHit)
+    {
+      srand(31);
+      std::vector<detail::Point *> points;
+      for (std::size_t i = 0; i < 40 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        points.push_back(new detail::Point {
+          0, static_cast<int32_t>(i),
+          frand(-16.0f, +16.0f), frand(-16.0f, +16.0f)
+        });
+      }
+      QuadTree tree(points.begin(), points.end());
+
+      const float segments[][4] = {
+        { -15.0f, -12.0f, +14.0f, +9.0f },
+        { +10.0f, -16.0f, +10.0f, +16.0f },
+        { +3.0f, +3.0f, +3.0f, +3.0f },
+        { -20.0f, +5.0f, +20.0f, +5.5f },
+      };
+      for (const auto& s : segments) {
+        for (float radius : { 0.0f, 0.3f, 1.5f }) {
+          const float dx = s[2] - s[0];
+          const float dy = s[3] - s[1];
+          const float length_sq = dx * dx + dy * dy;
+          std::size_t expected = 0;
+          float first_t = 2.0f;
+          for (const detail::Point* p : points) {
+            float px = p->x - s[0];
+            float py = p->y - s[1];
+            float t = length_sq > 0.0f ?
+              (px * dx + py * dy) / length_sq : 0.0f;
+            t = (std::min)((std::max)(t, 0.0f), 1.0f);
+            float ex = px - t * dx;
+            float ey = py - t * dy;
+            if (ex * ex + ey * ey <= radius * radius) {
+              ++expected;
+              first_t = (std::min)(first_t, t);
+            }
+          }
+
+          std::vector<detail::Point> actual;
+          tree.query_segment(s[0], s[1], s[2], s[3], radius, actual);
+          Assert::AreEqual(expected, actual.size());
+
+          detail::Point hit = {};
+          bool found = tree.first_hit(s[0], s[1], s[2], s[3], radius, hit);
+          Assert::AreEqual(expected > 0, found);
+          if (found) {
+            float t = length_sq > 0.0f ?
+              ((hit.x - s[0]) * dx + (hit.y - s[1]) * dy) / length_sq : 0.0f;
+            t = (std::min)((std::max)(t, 0.0f), 1.0f);
+            Assert::AreEqual(first_t, t);
+          }
+        }
+      }
+
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestMergeTrees)
+    {
+      srand(37);
+      auto by_position = [](const detail::Point& lhs,
+        const detail::Point& rhs)
+        {
+          return lhs.x < rhs.x || (lhs.x == rhs.x && lhs.y < rhs.y);
+        };
+      auto check = [&](const QuadTree& tree,
+        const std::vector<detail::Point *>& points)
+        {
+          for (int i = 0; i < 20; ++i) {
+            float x = frand(-20.0f, +20.0f);
+            float y = frand(-20.0f, +20.0f);
+            const detail::Rect rect = { x, y, x + 6.0f, y + 4.0f };
+            std::vector<detail::Point> expected;
+            for (const detail::Point* p : points) {
+              if (detail::contains(rect, *p)) {
+                expected.push_back(*p);
+              }
+            }
+            std::vector<detail::Point> actual;
+            tree.query(rect, actual);
+            Assert::AreEqual(expected.size(), actual.size());
+            std::sort(expected.begin(), expected.end(), by_position);
+            std::sort(actual.begin(), actual.end(), by_position);
+            for (std::size_t j = 0; j < expected.size(); ++j) {
+              Assert::IsTrue(detail::same_point(expected[j], actual[j]));
+            }
+          }
+          QuadTree::Stats stats;
+          tree.compute_stats(stats);
+          Assert::AreEqual(points.size(), stats.point_count);
+        };
+
+      // Both halves span the same corners, so their bounds match and the
+      // trees are zipped; the right one is only dense in one quadrant.
+      std::vector<detail::Point *> left;
+      std::vector<detail::Point *> right;
+      for (auto* half : { &left, &right }) {
+        half->push_back(new detail::Point { 0, 0, -16.0f, -16.0f });
+        half->push_back(new detail::Point { 0, 0, +16.0f, +16.0f });
+      }
+      for (std::size_t i = 0; i < 6 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        left.push_back(new detail::Point {
+          0, static_cast<int32_t>(i),
+          frand(-16.0f, +16.0f), frand(-16.0f, +16.0f)
+        });
+        right.push_back(new detail::Point {
+          1, static_cast<int32_t>(i),
+          frand(-16.0f, 0.0f), frand(-16.0f, +16.0f)
+        });
+      }
+      std::vector<detail::Point *> both(left);
+      both.insert(both.end(), right.begin(), right.end());
+
+      QuadTree lhs(left.begin(), left.end());
+      QuadTree rhs(right.begin(), right.end());
+      QuadTree zipped = QuadTree::merge(std::move(lhs), std::move(rhs));
+      check(zipped, both);
+      QuadTree::Stats stats;
+      lhs.compute_stats(stats);
+      Assert::AreEqual(static_cast<std::size_t>(0), stats.point_count);
+
+      // Merged trees stay writable.
+      detail::Point extra = { 2, -1, +3.0f, +3.0f };
+      zipped.insert(extra);
+      Assert::IsTrue(zipped.erase(*right[5]));
+      Assert::IsTrue(zipped.erase(extra));
+      Assert::IsFalse(zipped.erase(extra));
+
+      // Offset bounds fall back to merging by key.
+      std::vector<detail::Point *> far;
+      for (std::size_t i = 0; i < 3 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        far.push_back(new detail::Point {
+          3, static_cast<int32_t>(i),
+          frand(+8.0f, +30.0f), frand(-4.0f, +30.0f)
+        });
+      }
+      QuadTree offset(far.begin(), far.end());
+      QuadTree keyed = QuadTree::merge(std::move(zipped), std::move(offset));
+      std::vector<detail::Point *> all;
+      for (detail::Point* p : both) {
+        if (p != right[5]) {
+          all.push_back(p);
+        }
+      }
+      all.insert(all.end(), far.begin(), far.end());
+      check(keyed, all);
+
+      // An empty side hands over the other tree as is.
+      QuadTree moved = QuadTree::merge(std::move(zipped), std::move(keyed));
+      check(moved, all);
+
+      release_resources(both);
+      release_resources(far);
+    }
+
+    TEST_METHOD(TestIdIndex)
+    {
+      srand(41);
+      const int64_t base = int64_t(1) << 40;
+      std::vector<detail::Point *> points;
+      for (std::size_t i = 0; i < 8 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        points.push_back(new detail::Point {
+          base + static_cast<int64_t>(i), static_cast<int32_t>(i),
+          frand(-16.0f, +16.0f), frand(-16.0f, +16.0f)
+        });
+      }
+      QuadTree tree(points.begin(), points.end());
+      Assert::IsFalse(tree.has_id_index());
+      tree.set_id_index(true);
+      Assert::IsTrue(tree.has_id_index());
+
+      ChangeLog log;
+      tree.set_change_log(&log);
+      std::ostringstream checkpoint;
+      tree.write_checkpoint(checkpoint);
+
+      detail::Point found = {};
+      Assert::IsTrue(tree.find(base + 7, found));
+      Assert::IsTrue(detail::same_point(*points[7], found));
+      Assert::IsFalse(tree.find(7, found));
+      Assert::ExpectException<std::runtime_error>([&]()
+        {
+          tree.insert(*points[3]);
+        });
+
+      // Move every tenth point, erase every seventh, and pile new points
+      // into one corner so its leaves split under the index.
+      std::vector<detail::Point> expected;
+      for (std::size_t i = 0; i < points.size(); ++i) {
+        detail::Point p = *points[i];
+        if (i % 7 == 0) {
+          Assert::IsTrue(tree.erase(p.id));
+          Assert::IsFalse(tree.erase(p.id));
+          continue;
+        }
+        if (i % 10 == 0) {
+          p.x = frand(-24.0f, +24.0f);
+          p.y = frand(-24.0f, +24.0f);
+          Assert::IsTrue(tree.move(p.id, p.x, p.y));
+        }
+        expected.push_back(p);
+      }
+      for (std::size_t i = 0; i < 3 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        detail::Point p = {
+          -static_cast<int64_t>(i) - 1, static_cast<int32_t>(i),
+          frand(12.0f, 16.0f), frand(12.0f, 16.0f)
+        };
+        tree.insert(p);
+        expected.push_back(p);
+      }
+      for (const detail::Point& p : expected) {
+        Assert::IsTrue(tree.find(p.id, found));
+        Assert::IsTrue(detail::same_point(p, found));
+      }
+      Assert::IsFalse(tree.find(base, found));
+
+      // A replica fed the log keeps its own index in step.
+      std::istringstream in(checkpoint.str());
+      std::vector<detail::Point *> none;
+      QuadTree replica(none.begin(), none.end());
+      replica.set_id_index(true);
+      replica.read_checkpoint(in);
+      replica.apply_log(log.data());
+      for (const detail::Point& p : expected) {
+        Assert::IsTrue(replica.find(p.id, found));
+        Assert::IsTrue(detail::same_point(p, found));
+      }
+      const detail::Rect everything = { -30.0f, -30.0f, +30.0f, +30.0f };
+      std::vector<detail::Point> all;
+      replica.query(everything, all);
+      Assert::AreEqual(expected.size(), all.size());
+
+      points.push_back(new detail::Point(*points[0]));
+      QuadTree twins(points.begin(), points.end());
+      Assert::ExpectException<std::runtime_error>([&]()
+        {
+          twins.set_id_index(true);
+        });
+      Assert::IsFalse(twins.has_id_index());
+
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestExpiringPoints)
+    {
+      srand(43);
+      std::vector<detail::Point *> points;
+      for (std::size_t i = 0; i < 500; ++i) {
+        points.push_back(new detail::Point {
+          static_cast<int64_t>(i), static_cast<int32_t>(i),
+          frand(-16.0f, +16.0f), frand(-16.0f, +16.0f)
+        });
+      }
+      QuadTree tree(points.begin(), points.end());
+      tree.set_id_index(true);
+      tree.set_generation_span(10);
+      Assert::AreEqual(static_cast<uint64_t>(10), tree.generation_span());
+
+      std::ostringstream checkpoint;
+      tree.write_checkpoint(checkpoint);
+      ChangeLog log;
+      tree.set_change_log(&log);
+
+      // Sightings expire from 0 to 99; every 50th moves, every 70th is
+      // erased, and moves and erases keep or drop the expiry with them.
+      std::vector<std::pair<uint64_t, detail::Point>> live;
+      for (std::size_t i = 0; i < 8 * QuadTree::MAX_BLOCK_SIZE; ++i) {
+        detail::Point p = {
+          1000 + static_cast<int64_t>(i), static_cast<int32_t>(i),
+          frand(-16.0f, +16.0f), frand(-16.0f, +16.0f)
+        };
+        uint64_t expires_at = rand() % 100;
+        tree.insert(p, expires_at);
+        if (i % 70 == 0) {
+          Assert::IsTrue(tree.erase(p.id));
+          continue;
+        }
+        if (i % 50 == 0) {
+          p.x = frand(-20.0f, +20.0f);
+          p.y = frand(-20.0f, +20.0f);
+          Assert::IsTrue(tree.move(p.id, p.x, p.y));
+        }
+        live.emplace_back(expires_at, p);
+      }
+      Assert::ExpectException<std::runtime_error>([&]()
+        {
+          tree.set_generation_span(5);
+        });
+
+      const detail::Rect everything = { -30.0f, -30.0f, +30.0f, +30.0f };
+      auto check = [&](const QuadTree& t, uint64_t now)
+        {
+          std::size_t expected = points.size();
+          for (const auto& entry : live) {
+            expected += entry.first > now ? 1 : 0;
+          }
+          std::vector<detail::Point> all;
+          t.query(everything, all);
+          Assert::AreEqual(expected, all.size());
+        };
+
+      // Generations are 10 units wide, so at 29 everything expiring before
+      // 30 is gone and nothing else.
+      std::size_t due = 0;
+      for (const auto& entry : live) {
+        due += entry.first < 30 ? 1 : 0;
+      }
+      Assert::AreEqual(due, tree.expire(29));
+      Assert::AreEqual(static_cast<std::size_t>(0), tree.expire(29));
+      check(tree, 29);
+      detail::Point found = {};
+      for (const auto& entry : live) {
+        Assert::AreEqual(entry.first >= 30, tree.find(entry.second.id,
+          found));
+      }
+
+      std::istringstream in(checkpoint.str());
+      std::vector<detail::Point *> none;
+      QuadTree replica(none.begin(), none.end());
+      replica.read_checkpoint(in);
+      replica.apply_log(log.data());
+      check(replica, 29);
+
+      std::ostringstream saved;
+      tree.write_checkpoint(saved);
+      std::istringstream saved_in(saved.str());
+      QuadTree restored(none.begin(), none.end());
+      restored.read_checkpoint(saved_in);
+      Assert::AreEqual(static_cast<uint64_t>(10), restored.generation_span());
+      restored.expire(59);
+      check(restored, 59);
+
+      // Once every sighting is gone the leaves fold back into the root.
+      log.clear();
+      tree.expire(99);
+      check(tree, 99);
+      replica.apply_log(log.data());
+      check(replica, 99);
+      QuadTree::Stats stats;
+      tree.compute_stats(stats);
+      Assert::AreEqual(static_cast<std::size_t>(1), stats.node_count);
+
+      release_resources(points);
+    }
+
+    TEST_METHOD(TestMaximumDepthAfterGrowth)
+    {
+      // Identical points split their leaf down to the maximum depth, where
+      // one more level of growth leaves no room in the key, so the tree
+      // refuses to grow and stays as it was.
+      std::vector<detail::Point*> points;
+      for (int32_t i = 0; i < 3000; ++i) {
+        float x = i < 5 ? frand(-1.0f, +1.0f) : 0.25f;
+        float y = i < 5 ? frand(-1.0f, +1.0f) : 0.25f;
+        points.push_back(new detail::Point { i, i, x, y });
+      }
+      QuadTree tree(points.begin(), points.end());
+      Assert::AreEqual(detail::max_depth(), tree.max_depth());
+
+      const detail::Rect bounds = tree.global_bounds();
+      Assert::ExpectException<std::runtime_error>([&]()
+        {
+          tree.insert({ 3000, 3000, +100.0f, +100.0f });
+        });
+      Assert::AreEqual(bounds.hx, tree.global_bounds().hx);
+      Assert::IsTrue(tree.erase(*points[10]));
+      release_resources(points);
+    }
   };
 }